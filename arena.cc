@@ -0,0 +1,66 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <mutex>
+
+namespace {
+
+// 释放掉的块放在这里，避免反复mmap/munmap
+std::mutex g_free_chunks_mutex;
+std::vector<char*> g_free_chunks;
+
+char* AllocateChunk() {
+  {
+    std::lock_guard lock(g_free_chunks_mutex);
+    if (!g_free_chunks.empty()) {
+      char* chunk = g_free_chunks.back();
+      g_free_chunks.pop_back();
+      return chunk;
+    }
+  }
+
+  // 多申请一块，以便按大页对齐
+  constexpr size_t kSize = Arena::kChunkSize;
+  char* p = static_cast<char*>(mmap(nullptr, kSize * 2, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  char* chunk = reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(p) + kSize - 1) & ~(kSize - 1));
+  if (chunk != p) munmap(p, chunk - p);
+  munmap(chunk + kSize, p + kSize * 2 - (chunk + kSize));
+#ifdef MADV_HUGEPAGE
+  madvise(chunk, kSize, MADV_HUGEPAGE);
+#endif
+  return chunk;
+}
+
+}  // namespace
+
+void* Arena::NewChunk(size_t size, size_t align) {
+  if (size + align > kChunkSize) {
+    fprintf(stderr, "Arena allocation too large: %zu\n", size);
+    exit(1);
+  }
+  char* chunk = AllocateChunk();
+  chunks_.push_back(chunk);
+  char* p = reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(chunk) + align - 1) & ~(align - 1));
+  end_ = chunk + kChunkSize;
+  return p;
+}
+
+void Arena::Reset() {
+  if (!chunks_.empty()) {
+    std::lock_guard lock(g_free_chunks_mutex);
+    g_free_chunks.insert(g_free_chunks.end(), chunks_.begin(), chunks_.end());
+  }
+  chunks_.clear();
+  ptr_ = end_ = nullptr;
+}
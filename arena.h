@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// 简易的bump allocator
+// 内存按块向系统申请（尽量使用大页），分配出去的对象不单独释放，只能整体Reset
+class Arena {
+ public:
+  // 每个块的大小，与x86-64的大页一致
+  static constexpr size_t kChunkSize = 2 << 20;
+
+  Arena() = default;
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena() { Reset(); }
+
+  void* Allocate(size_t size, size_t align) {
+    char* p = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(ptr_) + align - 1) & ~(align - 1));
+    if (end_ - p < ptrdiff_t(size))
+      p = static_cast<char*>(NewChunk(size, align));
+    ptr_ = p + size;
+    return p;
+  }
+
+  // 不会调用析构函数，所以只能用于可以平凡析构的类型
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    return new (Allocate(sizeof(T), alignof(T)))
+        T{std::forward<Args>(args)...};
+  }
+
+  // 整体释放，块会被缓存起来供以后复用
+  void Reset();
+
+ private:
+  void* NewChunk(size_t size, size_t align);
+
+ private:
+  char* ptr_ = nullptr;
+  char* end_ = nullptr;
+  std::vector<char*> chunks_;
+};
@@ -0,0 +1,68 @@
+#include "beam_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "tetris_common.h"
+
+namespace {
+
+// 比这更小的beam（开局时）的耗时主要是固定开销，不用来估计每个结点的耗时
+constexpr size_t kMinMeasuredBeam = 32;
+// 每个结点耗时的滑动平均中新测量值的权重
+constexpr double kSmoothing = 1. / 32;
+
+// 宽度太小时很容易走进死局，除非--total_keep本身就更小，不低于这个数
+constexpr unsigned kMinKeep = 64;
+
+// 用最近这么多步的最高分判断beam是否在挣扎
+constexpr size_t kWindow = 200;
+// StruggleFactor的范围。得分本来就是一阵一阵的，系数太大反而浪费时间
+constexpr double kMinFactor = 0.9;
+constexpr double kMaxFactor = 1.2;
+
+}  // namespace
+
+BeamScheduler::BeamScheduler(double budget_seconds, unsigned base_keep)
+    : budget_us_(budget_seconds * 1e6), base_keep_(base_keep) {}
+
+void BeamScheduler::Start() {
+  elapsed_us_ = 0;
+  stopwatch_.Lap();
+}
+
+unsigned BeamScheduler::NextKeep(size_t beam,
+                                 std::span<const unsigned> score_by_step) {
+  // 上次调用以来正好是一步
+  uint64_t step_us = stopwatch_.Lap();
+  elapsed_us_ += step_us;
+  if (beam >= kMinMeasuredBeam) {
+    double us = double(step_us) / double(beam);
+    if (us_per_node_ == 0) {
+      us_per_node_ = us;
+    } else {
+      us_per_node_ += (us - us_per_node_) * kSmoothing;
+    }
+  }
+  if (us_per_node_ == 0) return base_keep_;
+
+  // 包括这一步在内还要选这么多次
+  size_t remaining_steps = kSteps - score_by_step.size();
+  double remaining_us = std::max(budget_us_ - double(elapsed_us_), 0.);
+  double keep = remaining_us / double(remaining_steps) / us_per_node_ *
+                StruggleFactor(score_by_step);
+  unsigned min_keep =
+      std::min(base_keep_, std::max(base_keep_ / kMaxScale, kMinKeep));
+  return std::clamp(keep, double(min_keep), double(base_keep_ * kMaxScale));
+}
+
+double BeamScheduler::StruggleFactor(std::span<const unsigned> score_by_step) {
+  size_t n = score_by_step.size();
+  if (n < 2 * kWindow || score_by_step[n - 1] == 0) return 1;
+  // 整局平均每步得分与最近每步得分之比，开方以减小波动
+  double overall = double(score_by_step[n - 1]) / double(n);
+  double recent =
+      double(score_by_step[n - 1] - score_by_step[n - 1 - kWindow]) / kWindow;
+  if (recent <= 0) return kMaxFactor;
+  return std::clamp(std::sqrt(overall / recent), kMinFactor, kMaxFactor);
+}
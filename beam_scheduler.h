@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <span>
+
+#include "telemetry.h"
+
+// 按时间预算调整每一步选出的结点总数（--time_budget）
+// 在线测量展开一个结点平均要花多少时间，用剩余时间除以剩余步数得到每一步
+// 可用的时间，从而算出宽度。最高分增长得比整局平均慢时说明beam正在挣扎，
+// 临时加宽，反之收窄；多花或者少花的时间会自动摊到剩下的各步中。
+// 时间按墙上时间计算，多配置时每一步的耗时包括所有配置的。
+class BeamScheduler {
+ public:
+  // budget_seconds为0表示不调整，一直用base_keep
+  // 宽度限制在base_keep的kMaxScale分之一到kMaxScale倍之间，并且不低于kMinKeep
+  BeamScheduler(double budget_seconds, unsigned base_keep);
+
+  bool enabled() const { return budget_us_ > 0; }
+
+  // 开始计时
+  void Start();
+
+  // 一步的结点展开完以后调用，beam是这一步展开的结点数
+  // 返回选择下一步的结点时用的总数，score_by_step是之前各步的最高分
+  unsigned NextKeep(size_t beam, std::span<const unsigned> score_by_step);
+
+ private:
+  // 按最高分的增长速度给宽度乘上的系数
+  static double StruggleFactor(std::span<const unsigned> score_by_step);
+
+ private:
+  static constexpr unsigned kMaxScale = 8;
+  double budget_us_;
+  unsigned base_keep_;
+  uint64_t elapsed_us_ = 0;
+  Stopwatch stopwatch_;
+  double us_per_node_ = 0;  // 展开一个结点平均的耗时，指数滑动平均
+};
@@ -0,0 +1,144 @@
+#include <gflags/gflags.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "benchmark.h"
+#include "corpus.h"
+#include "search.h"
+#include "tetris_common.h"
+
+// 各个核心函数的微基准测试，输入是从实际搜索中采集的局面样本
+// 先用 main --capture_corpus=<文件> 采集样本，再运行 bench --corpus=<文件>
+
+DEFINE_string(corpus, "out/corpus.bin", "样本文件，由main --capture_corpus生成");
+DEFINE_string(filter, "", "只运行名字包含这个字符串的测试");
+DEFINE_double(min_seconds, 1, "每个测试至少运行的时间（秒）");
+
+namespace {
+
+// 一个局面的一个可达落点
+struct LandingRef {
+  uint32_t index;  // 局面在样本中的下标
+  BrickStatus st;
+};
+
+void BenchmarkKernels(std::span<const Situation> corpus, Benchmark* bench) {
+  size_t n = corpus.size();
+
+  // 预先算好各个函数的输入
+  std::vector<PlacementMap> maps(n);
+  std::vector<RouteMap> routes(n);
+  std::vector<LandingRef> landings;
+  std::vector<Situation> placed;  // 放下方块、尚未消行的局面
+  for (uint32_t i = 0; i < n; ++i) {
+    auto [shp, initial_st] = kBricks[corpus[i].step_];
+    maps[i] = corpus[i].MakePlacementMap(shp);
+    routes[i].Build(maps[i], initial_st);
+    for (uint8_t rot = 0; rot < routes[i].rot_cnt; ++rot) {
+      for (int8_t y = 0; y < int8_t(kH); ++y) {
+        uint32_t bits = routes[i].LandingBitmask(maps[i], rot, y);
+        for (; bits; bits = blsr(bits)) {
+          BrickStatus st{int8_t(ctz(bits)), y, rot};
+          landings.push_back({i, st});
+          placed.push_back(corpus[i].PutCopy(shp, st));
+        }
+      }
+    }
+  }
+
+  bench->Run("Situation::Fits", n * 4 * kW * kH, [&] {
+    for (const Situation& situ : corpus) {
+      Shape shp = kBricks[situ.step_].first;
+      for (uint8_t rot = 0; rot < 4; ++rot)
+        for (int8_t y = 0; y < int8_t(kH); ++y)
+          for (int8_t x = 0; x < int8_t(kW); ++x)
+            DoNotOptimize(situ.Fits(shp, {x, y, rot}));
+    }
+  });
+
+  bench->Run("Situation::MakePlacementMap", n, [&] {
+    for (const Situation& situ : corpus)
+      DoNotOptimize(situ.MakePlacementMap(kBricks[situ.step_].first));
+  });
+
+  bench->Run("RouteMap::Build", n, [&] {
+    RouteMap route;
+    for (size_t i = 0; i < n; ++i) {
+      route.Build(maps[i], kBricks[corpus[i].step_].second);
+      DoNotOptimize(route);
+    }
+  });
+
+  bench->Run("Situation::FindAllMoves", n, [&] {
+    CandidateVector vec;
+    for (size_t i = 0; i < n; ++i) {
+      vec.clear();
+      corpus[i].FindAllMoves(maps[i], kBricks[corpus[i].step_].second, &vec);
+      DoNotOptimize(vec.data());
+    }
+  });
+
+  bench->Run("RouteMap::AppendRoute", landings.size(), [&] {
+    ActionVector actions;
+    for (const LandingRef& landing : landings) {
+      actions.clear();
+      routes[landing.index].AppendRoute(landing.st, &actions);
+      DoNotOptimize(actions.data());
+    }
+  });
+
+  bench->Run("Situation::PutCopy", landings.size(), [&] {
+    for (const LandingRef& landing : landings) {
+      const Situation& situ = corpus[landing.index];
+      DoNotOptimize(situ.PutCopy(kBricks[situ.step_].first, landing.st));
+    }
+  });
+
+  // 包括复制局面的开销
+  bench->Run("Situation::CollapseInPlace", placed.size(), [&] {
+    for (const Situation& orig : placed) {
+      Situation situ = orig;
+      situ.CollapseInPlace();
+      DoNotOptimize(situ);
+    }
+  });
+
+  QualityWeights weights = QualityWeights::FromFlags();
+  bench->Run("Situation::Quality", n, [&] {
+    for (const Situation& situ : corpus) DoNotOptimize(situ.Quality(weights));
+  });
+
+  bench->Run("Situation::IsOk", n, [&] {
+    for (const Situation& situ : corpus) DoNotOptimize(situ.IsOk());
+  });
+
+  std::vector<int> quality(n);
+  std::vector<unsigned> height(n);
+  auto ok = std::make_unique<bool[]>(n);
+  bench->Run("EvaluateBatch", n, [&] {
+    EvaluateBatch(corpus, weights, quality.data(), height.data(), ok.get());
+    DoNotOptimize(quality.data());
+  });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::vector<Situation> corpus;
+  if (!LoadCorpus(FLAGS_corpus, &corpus)) {
+    fprintf(stderr, "Failed to load corpus %s\n", FLAGS_corpus.c_str());
+    return 1;
+  }
+  printf("Loaded %zu situations from %s\n", corpus.size(),
+         FLAGS_corpus.c_str());
+
+  Benchmark bench(FLAGS_filter, FLAGS_min_seconds);
+  BenchmarkKernels(corpus, &bench);
+  BenchmarkSearch(corpus, &bench);
+  return 0;
+}
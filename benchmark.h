@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+
+// 简单的微基准测试框架
+// 每个测试反复执行，直到总时间超过min_seconds，报告每次操作的耗时和吞吐
+
+// 阻止编译器把结果没有用到的计算优化掉
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class Benchmark {
+ public:
+  // 只运行名字包含filter的测试
+  Benchmark(std::string filter, double min_seconds)
+      : filter_(std::move(filter)), min_seconds_(min_seconds) {}
+
+  // func()每调用一次执行ops次操作
+  template <typename Callback>
+  void Run(const std::string& name, size_t ops, Callback&& func) {
+    if (name.find(filter_) == name.npos || ops == 0) return;
+
+    using Clock = std::chrono::steady_clock;
+    func();  // 预热
+    size_t iterations = 0;
+    auto start = Clock::now();
+    std::chrono::duration<double> elapsed{};
+    do {
+      func();
+      ++iterations;
+      elapsed = Clock::now() - start;
+    } while (elapsed.count() < min_seconds_);
+
+    double total_ops = double(ops) * iterations;
+    printf("%-32s %12.1f ns/op %14.0f ops/s %10zu ops\n", name.c_str(),
+           elapsed.count() * 1e9 / total_ops, total_ops / elapsed.count(),
+           size_t(total_ops));
+    fflush(stdout);
+  }
+
+ private:
+  std::string filter_;
+  double min_seconds_;
+};
@@ -0,0 +1,45 @@
+#include "corpus.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "snapshot.h"
+
+namespace {
+
+constexpr uint64_t kCorpusMagic = 0x50524f4352544554;  // "TETRCORP"
+constexpr uint32_t kCorpusVersion = 1;
+
+struct CorpusHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t steps;  // 与kSteps一致才能使用
+};
+
+}  // namespace
+
+bool SaveCorpus(const std::string& path, std::span<const Situation> situs) {
+  SnapshotWriter writer;
+  writer.AddValue(CorpusHeader{kCorpusMagic, kCorpusVersion, kSteps});
+  writer.Add(situs);
+  return writer.Commit(path);
+}
+
+bool LoadCorpus(const std::string& path, std::vector<Situation>* res) {
+  SnapshotReader reader;
+  if (!reader.Open(path)) return false;
+
+  CorpusHeader header;
+  std::span<const Situation> situs;
+  if (!reader.ReadValue(&header) || !reader.Read(&situs)) {
+    fprintf(stderr, "Corpus %s is truncated\n", path.c_str());
+    return false;
+  }
+  if (header.magic != kCorpusMagic || header.version != kCorpusVersion ||
+      header.steps != kSteps) {
+    fprintf(stderr, "Corpus %s is incompatible\n", path.c_str());
+    return false;
+  }
+  res->assign(situs.begin(), situs.end());
+  return true;
+}
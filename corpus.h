@@ -0,0 +1,16 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <vector>
+
+#include "tetris_common.h"
+
+// 基准测试用的局面样本，从实际的搜索过程中采集（见--capture_corpus）
+// 文件格式与快照相同，内容是一个Situation数组
+
+// 写入path，失败返回false
+bool SaveCorpus(const std::string& path, std::span<const Situation> situs);
+
+// 从path读出，失败返回false
+bool LoadCorpus(const std::string& path, std::vector<Situation>* res);
@@ -82,21 +82,27 @@ def not_(s):
 
 
 class Running:
-    def __init__(self, genome, str_params, abort_threshold):
-        self.genome = genome
-        self.str_params = str_params
-        self.abort_threshold = abort_threshold
+    '''一个./main进程，用多配置模式同时搜索一批genome'''
+
+    def __init__(self, batch):
+        # batch: list of (genome, str_params, abort_threshold)
+        self.batch = batch
+        self.configs = tempfile.NamedTemporaryFile('w')
         self.stdout = tempfile.NamedTemporaryFile()
         self.stderr = tempfile.NamedTemporaryFile()
 
-        str_threshold = ','.join(map(str, abort_threshold))
+        for _, str_params, abort_threshold in batch:
+            str_threshold = ','.join(map(str, abort_threshold))
+            print('{} --abort_threshold={}'.format(str_params, str_threshold),
+                  file=self.configs)
+        self.configs.flush()
         self.proc = subprocess.Popen(
-                ['./main'] + str_params.split(' ') +
-                ['--abort_threshold={}'.format(str_threshold)],
+                ['./main', '--configs={}'.format(self.configs.name)],
                 stdout=self.stdout, stderr=self.stderr)
         self.result = None
 
     def poll(self):
+        '''Returns list of (genome, str_params, (score, score_by_step))'''
         if self.result is not None:
             return self.result
         if self.proc.poll() is None:
@@ -105,23 +111,28 @@ class Running:
         self.stdout.seek(0)
         out = self.stdout.read()
 
-        m = re.search(br'final_score=(\d+)', out)
-        final_score = int(m.group(1))
+        blocks = re.split(br'^config=\d+$', out, flags=re.M)[1:]
+        self.result = []
+        for (genome, str_params, _), block in zip(self.batch, blocks):
+            m = re.search(br'final_score=(\d+)', block)
+            final_score = int(m.group(1))
 
-        m = re.search(br'score_by_step=([\d,]*)', out)
-        score_by_step = [int(x) for x in m.group(1).split(b',') if x]
-        self.result = final_score, score_by_step
+            m = re.search(br'score_by_step=([\d,]*)', block)
+            score_by_step = [int(x) for x in m.group(1).split(b',') if x]
+            self.result.append(
+                    (genome, str_params, (final_score, score_by_step)))
         return self.result
 
 
 class State:
     _cache_file = 'out/genetic.cache'
-    _max_parallel = 8
+    # 每个进程同时搜索的配置数，各配置共用进程内的线程池
+    _batch_size = 8
 
     def __init__(self):
         self.done_genomes = {}  # genome -> str_params
         self.results = {}  # str_params -> (score, score_by_step)
-        self.running = []  # type: list[Running]
+        self.running = None  # type: Running | None
         self.pending = self.get_initial_genomes()  # type: list[str]
 
         self.load_cache()
@@ -200,13 +211,14 @@ class State:
 
         return self.pending.pop()
 
-    def run_new(self):
+    def next_new(self, batch):
+        '''Returns the next genome not done or running yet'''
         while True:
             genome = self.get_next_genome()
             if genome in self.done_genomes:
                 print('Already done {}'.format(genome))
                 continue
-            if any(r.genome == genome for r in self.running):
+            if any(g == genome for g, _, _ in batch):
                 print('Already running {}'.format(genome))
                 continue
             str_params = genome_to_params(genome)
@@ -214,31 +226,35 @@ class State:
                 self.done_genomes[genome] = str_params
                 print('Hit cache {}'.format(genome))
                 continue
+            return genome, str_params
 
-            bests = self.get_bests(20)
-            if len(bests) >= 20:
-                abort_threshold = [max(x - 1000, 0) for x in bests[19][1][1]]
-            else:
-                abort_threshold = []
+    def run_new(self):
+        bests = self.get_bests(20)
+        if len(bests) >= 20:
+            abort_threshold = [max(x - 1000, 0) for x in bests[19][1][1]]
+        else:
+            abort_threshold = []
+
+        batch = []
+        while len(batch) < self._batch_size:
+            genome, str_params = self.next_new(batch)
             print('Starting {}'.format(genome))
-            r = Running(genome, genome_to_params(genome), abort_threshold)
-            self.running.append(r)
-            return
+            batch.append((genome, str_params, abort_threshold))
+        self.running = Running(batch)
 
     def ping(self):
-        for i in range(len(self.running) - 1, -1, -1):
-            r = self.running[i]
-            result = r.poll()
-            if result:
-                print('Done {} {}'.format(r.genome, result[0]))
+        results = self.running.poll() if self.running else None
+        if results:
+            for genome, str_params, result in results:
+                print('Done {} {}'.format(genome, result[0]))
                 with open('out/genetic.log', 'a') as f:
-                    print('{} {}'.format(result[0], r.str_params), file=f)
-                self.results[r.str_params] = result
-                self.done_genomes[r.genome] = r.str_params
-                self.save_cache()
-                self.running[i:i+1] = []
+                    print('{} {}'.format(result[0], str_params), file=f)
+                self.results[str_params] = result
+                self.done_genomes[genome] = str_params
+            self.save_cache()
+            self.running = None
 
-        while len(self.running) < self._max_parallel:
+        if self.running is None:
             self.run_new()
 
         best = self.get_best()
@@ -2,6 +2,10 @@
 #include <absl/strings/str_join.h>
 #include <gflags/gflags.h>
 
+#include <fstream>
+#include <string>
+#include <vector>
+
 #include "search.h"
 #include "tetris_common.h"
 
@@ -13,11 +17,27 @@ inline constexpr const char* kUploadTemplate =
 inline constexpr const char* kReplayTemplate =
     "game.pause();game.playRecord('%s'.split(','));";
 
-int main(int argc, char** argv) {
-  gflags::ParseCommandLineFlags(&argc, &argv, true);
+DEFINE_string(configs, "",
+              "同时搜索多组参数，文件每行是一组flags，空行和#开头的行忽略");
 
-  auto res = Solve();
+static std::vector<std::string> ReadConfigs(const std::string& path) {
+  std::ifstream in(path);
+  if (!in) {
+    fprintf(stderr, "Failed to open %s\n", path.c_str());
+    exit(1);
+  }
+  std::vector<std::string> res;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    size_t pos = line.find_first_not_of(' ');
+    if (pos == line.npos || line[pos] == '#') continue;
+    res.push_back(line);
+  }
+  return res;
+}
 
+static void Output(const Solution& res) {
   printf("Final steps: %u\n", res.final_situ.step_);
   printf("%s\n", res.final_situ.DebugString().c_str());
 
@@ -36,6 +56,26 @@ int main(int argc, char** argv) {
   fp = fopen(absl::StrCat("out/", score, ".replay.js").c_str(), "w");
   fprintf(fp, kReplayTemplate, action_str.c_str());
   fclose(fp);
+}
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_configs.empty()) {
+    Output(Solve());
+    return 0;
+  }
 
+  std::vector<std::string> configs = ReadConfigs(FLAGS_configs);
+  if (configs.empty()) {
+    fprintf(stderr, "No configuration in %s\n", FLAGS_configs.c_str());
+    return 1;
+  }
+  auto results = SolveConfigs(configs);
+  for (size_t i = 0; i < results.size(); ++i) {
+    // Output for genetic.py: each block begins with config=<index>
+    printf("config=%zu\n", i);
+    Output(results[i]);
+  }
   return 0;
 }
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <numeric>
+#include <span>
+#include <vector>
+
+#include "thread_pool.h"
+
+// 基于ThreadPool的并行原语
+// 数据都按固定的方式切成若干块，块内串行处理，块间的结果按块的顺序合并，
+// 所以结果与线程数和调度无关
+
+// 数据量少于这么多时直接串行处理
+constexpr size_t kParallelMinSize = 4096;
+
+// 把[0, n)切成的块数
+inline size_t ParallelBlockCount(const ThreadPool& pool, size_t n) {
+  if (n < kParallelMinSize || pool.size() == 1) return 1;
+  return std::min<size_t>(pool.size() * 4, n / (kParallelMinSize / 4));
+}
+
+// 对每一块[begin, end)调用func(block, begin, end)
+template <typename Callback>
+void ParallelForEachBlock(ThreadPool& pool, size_t n, size_t blocks,
+                          Callback func) {
+  if (blocks <= 1) {
+    func(size_t(0), size_t(0), n);
+    return;
+  }
+  pool.SyncRunRange(blocks, 1, [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; ++i)
+      func(i, n * i / blocks, n * (i + 1) / blocks);
+  });
+}
+
+// 对每块用map(begin, end)求出一个值，再按块的顺序用combine合并
+template <typename T, typename Map, typename Combine>
+T ParallelReduce(ThreadPool& pool, size_t n, T init, Map map,
+                 Combine combine) {
+  size_t blocks = ParallelBlockCount(pool, n);
+  std::vector<T> partial(blocks, init);
+  ParallelForEachBlock(pool, n, blocks,
+                       [&](size_t i, size_t begin, size_t end) {
+                         partial[i] = map(begin, end);
+                       });
+  T res = std::move(init);
+  for (T& x : partial) res = combine(std::move(res), std::move(x));
+  return res;
+}
+
+// 相当于std::erase_if，保持剩余元素的相对顺序
+template <typename T, typename Pred>
+void ParallelEraseIf(ThreadPool& pool, std::vector<T>& vec, Pred pred) {
+  size_t n = vec.size();
+  size_t blocks = ParallelBlockCount(pool, n);
+  if (blocks <= 1) {
+    std::erase_if(vec, pred);
+    return;
+  }
+
+  // 先各块原地压缩，再依次搬到前面
+  std::vector<size_t> kept(blocks);
+  ParallelForEachBlock(
+      pool, n, blocks, [&](size_t i, size_t begin, size_t end) {
+        auto it = std::remove_if(vec.begin() + begin, vec.begin() + end, pred);
+        kept[i] = it - (vec.begin() + begin);
+      });
+  std::vector<size_t> offset(blocks);
+  std::exclusive_scan(kept.begin(), kept.end(), offset.begin(), size_t(0));
+  size_t total = offset.back() + kept.back();
+
+  std::vector<T> res(total);
+  ParallelForEachBlock(pool, n, blocks, [&](size_t i, size_t begin, size_t) {
+    std::move(vec.begin() + begin, vec.begin() + begin + kept[i],
+              res.begin() + offset[i]);
+  });
+  vec.swap(res);
+}
+
+// 相当于std::sort：各块分别排序，再两两归并
+// comp应当是全序，否则结果可能与std::sort不同
+template <typename T, typename Compare>
+void ParallelSort(ThreadPool& pool, std::vector<T>& vec, Compare comp) {
+  size_t n = vec.size();
+  size_t blocks = ParallelBlockCount(pool, n);
+  if (blocks <= 1) {
+    std::sort(vec.begin(), vec.end(), comp);
+    return;
+  }
+
+  auto bound = [&](size_t i) { return n * std::min(i, blocks) / blocks; };
+  ParallelForEachBlock(pool, n, blocks,
+                       [&](size_t, size_t begin, size_t end) {
+                         std::sort(vec.begin() + begin, vec.begin() + end,
+                                   comp);
+                       });
+
+  std::vector<T> buffer(n);
+  for (size_t width = 1; width < blocks; width *= 2) {
+    size_t pairs = (blocks + width * 2 - 1) / (width * 2);
+    pool.SyncRunRange(pairs, 1, [&](size_t first, size_t last) {
+      for (size_t k = first; k < last; ++k) {
+        size_t begin = bound(k * width * 2);
+        size_t mid = bound(k * width * 2 + width);
+        size_t end = bound(k * width * 2 + width * 2);
+        std::merge(vec.begin() + begin, vec.begin() + mid, vec.begin() + mid,
+                   vec.begin() + end, buffer.begin() + begin, comp);
+      }
+    });
+    vec.swap(buffer);
+  }
+}
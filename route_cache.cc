@@ -0,0 +1,67 @@
+#include "route_cache.h"
+
+RouteCache::RouteCache(size_t capacity)
+    : shard_capacity_((capacity + kShards - 1) / kShards),
+      shards_(std::make_unique<Shard[]>(kShards)) {}
+
+void RouteCache::MakeKey(const PlacementMap& map, BrickStatus initial_st,
+                         Key* key) {
+  // 整体清零，保证填充字节也参与比较和hash时结果确定
+  memset(key, 0, sizeof(Key));
+  key->shp = map.shp;
+  key->initial_st = initial_st;
+  if (!map.Fits(initial_st)) return;
+  unsigned max_y = map.MaxReachableY(initial_st);
+  for (unsigned rot = 0; rot < kShapeDesc[map.shp].cnt; ++rot) {
+    for (unsigned y = initial_st.y; y <= max_y + 1; ++y)
+      key->fits[rot][y] = map.fits[rot][y];
+  }
+}
+
+void RouteCache::FindAllMoves(const Situation& situ, const PlacementMap& map,
+                              BrickStatus initial_st, CandidateVector* res) {
+  if (shard_capacity_ == 0) {
+    situ.FindAllMoves(map, initial_st, res);
+    return;
+  }
+
+  Key key;
+  MakeKey(map, initial_st, &key);
+  size_t hash = absl::Hash<Key>()(key);
+  Shard& shard = shards_[hash % kShards];
+
+  std::shared_ptr<const LandingVector> landings;
+  {
+    std::lock_guard lock(shard.mutex);
+    if (auto it = shard.map.find(key); it != shard.map.end()) {
+      ++shard.hits;
+      landings = it->second;
+    } else {
+      ++shard.misses;
+    }
+  }
+
+  if (!landings) {
+    auto computed = std::make_shared<LandingVector>();
+    FindAllLandings(map, initial_st, computed.get());
+    landings = std::move(computed);
+
+    std::lock_guard lock(shard.mutex);
+    // 满了就整个清空，简单但足够用
+    if (shard.map.size() >= shard_capacity_) shard.map.clear();
+    shard.map.emplace(key, landings);
+  }
+
+  situ.FindAllMoves(map.shp, *landings, res);
+}
+
+RouteCache::Stats RouteCache::GetStats() const {
+  Stats stats;
+  for (size_t i = 0; i < kShards; ++i) {
+    std::lock_guard lock(shards_[i].mutex);
+    stats.hits += shards_[i].hits;
+    stats.misses += shards_[i].misses;
+    stats.entries += shards_[i].map.size();
+  }
+  return stats;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+#include <absl/container/flat_hash_map.h>
+
+#include "tetris_common.h"
+
+// 落点的缓存，多个线程共享
+// 落点只取决于方块从初始位置出发可能到达的区域，不同局面只要这个区域内
+// 的PlacementMap相同，结果就相同。束中很多局面只在深处被埋住的行上有差别，
+// 可以共享结果。
+class RouteCache {
+ public:
+  // capacity为最多缓存的条目数
+  explicit RouteCache(size_t capacity);
+
+  // 与Situation::FindAllMoves(map, initial_st, res)相同，但尽量使用缓存
+  void FindAllMoves(const Situation& situ, const PlacementMap& map,
+                    BrickStatus initial_st, CandidateVector* res);
+
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t entries = 0;
+  };
+  Stats GetStats() const;
+
+ private:
+  // 只保留可能到达的行（以及其下一行，用于判断落点）的PlacementMap
+  struct Key {
+    uint16_t fits[4][kH + 1];
+    BrickStatus initial_st;
+    Shape shp;
+
+    bool operator==(const Key& other) const {
+      return memcmp(this, &other, sizeof(Key)) == 0;
+    }
+
+    template <typename H>
+    friend H AbslHashValue(H h, const Key& key) {
+      return H::combine_contiguous(std::move(h),
+                                   reinterpret_cast<const char*>(&key),
+                                   sizeof(Key));
+    }
+  };
+
+  static_assert(std::has_unique_object_representations_v<Key>);
+
+  static void MakeKey(const PlacementMap& map, BrickStatus initial_st,
+                      Key* key);
+
+  struct alignas(64) Shard {
+    mutable std::mutex mutex;
+    absl::flat_hash_map<Key, std::shared_ptr<const LandingVector>> map;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+  static constexpr size_t kShards = 64;
+  size_t shard_capacity_;
+  std::unique_ptr<Shard[]> shards_;
+};
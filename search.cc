@@ -1,20 +1,35 @@
 #include "search.h"
 
+#include <limits.h>
 #include <sys/resource.h>
 
-#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <string_view>
+#include <utility>
 
 #include <absl/container/flat_hash_map.h>
-#include <absl/container/flat_hash_set.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_replace.h>
 #include <absl/strings/str_split.h>
-#include <boost/intrusive_ptr.hpp>
 #include <gflags/gflags.h>
 
+#include "arena.h"
+#include "beam_scheduler.h"
+#include "benchmark.h"
+#include "corpus.h"
+#include "parallel.h"
+#include "route_cache.h"
+#include "snapshot.h"
+#include "search_tree.h"
+#include "telemetry.h"
 #include "tetris_common.h"
 #include "thread_pool.h"
 
 DEFINE_int32(total_keep, 9041, "每一层选出结点总数量");
+DEFINE_double(time_budget, 0,
+              "时间预算（秒），大于0时按预算逐步调整每一层选出的结点数量，"
+              "--total_keep作为初始值");
 DEFINE_double(score_keep_ratio, 0.163, "选出的结点中按分数的比例");
 DEFINE_double(score_height_quota, 0.210, "砖块高度配额(score)");
 DEFINE_string(score_parent_quota, "0.3,0.5,0.7,0.9", "砖块祖先配额(score)");
@@ -25,211 +40,909 @@ DEFINE_int32(ignore_height_threshold, 6, "高度剪枝条件");
 
 DEFINE_string(abort_threshold, "", "在指定步数的最低分如果低于阈值，直接退出");
 
-// 根据flags计算出来的
-unsigned g_score_keep_count;
-unsigned g_quality_keep_count;
-std::vector<unsigned> g_score_parent_quota;
-std::vector<unsigned> g_quality_parent_quota;
-unsigned g_abort_threshold[kSteps]{};
+DEFINE_double(stream_keep_factor, 0,
+              "流式选择（有损）：去重时每个分区按两种key各只保留平均份额的"
+              "这么多倍，不能小于1，0表示全部保留");
+
+DEFINE_double(lookahead_factor, 0,
+              "向后看：按quality选择时先取quality最高的这么多倍个候选，"
+              "再按当前quality与放下接下来的方块后能达到的最高quality之和选，"
+              "0表示不向后看");
+DEFINE_uint32(lookahead_depth, 1, "向后看的方块数，最多为2");
+
+DEFINE_uint32(threads, 0, "线程数，0表示按可用的CPU数量");
+DEFINE_bool(pin_threads, false, "是否把每个线程绑定到一个CPU上");
+
+DEFINE_string(checkpoint_file, "",
+              "快照文件路径，其中的{step}会被替换为步数，空表示不保存快照");
+DEFINE_uint32(checkpoint_interval, 500, "每隔这么多步保存一次快照");
+DEFINE_string(resume_from, "", "从这个快照文件恢复，继续搜索");
+
+DEFINE_uint64(route_cache_size, 0, "落点和路径缓存的条目数，0表示不缓存");
+
+DEFINE_string(telemetry_file, "",
+              "每一步的耗时和结点数量写入这个文件，以.json结尾时为JSON Lines，"
+              "否则为CSV");
+
+DEFINE_string(verify, "final",
+              "验证操作序列：all验证每个子结点，sample抽样验证，"
+              "final只验证最终结果（三种都会验证最终结果）");
+
+DEFINE_string(capture_corpus, "",
+              "把搜索过程中的部分局面写入这个文件，作为bench的输入");
+
+// 子结点的验证方式，见--verify
+enum class VerifyMode { kAll, kSample, kFinal };
+VerifyMode g_verify_mode = VerifyMode::kFinal;
+
+// 抽样验证时每个线程每隔这么多个子结点验证一个
+constexpr unsigned kVerifySampleInterval = 64;
+
+// 向后看的方块数的上限，再多开销就太大了
+constexpr unsigned kMaxLookaheadDepth = 2;
+
+// 一组搜索参数，由flags计算出来
+// 多配置模式下每个配置各有一组，所以搜索过程中不直接读取这些flags
+struct SearchParams {
+  double score_keep_ratio;
+  std::vector<float> score_parent_ratio;
+  std::vector<float> quality_parent_ratio;
+  // 以下几个由SetTotalKeep按总数量计算
+  unsigned score_keep_count;
+  unsigned quality_keep_count;
+  double score_height_quota;
+  double quality_height_quota;
+  std::vector<unsigned> score_parent_quota;
+  std::vector<unsigned> quality_parent_quota;
+  int ignore_score_threshold;
+  int ignore_height_threshold;
+  std::vector<unsigned> abort_threshold;  // 长度为kSteps
+  unsigned total_keep;  // 开启--time_budget时只是初始值
+  double time_budget;
+  double stream_keep_factor;
+  double lookahead_factor;
+  unsigned lookahead_depth;
+  QualityWeights quality_weights;
+  std::string checkpoint_file;
+  unsigned checkpoint_interval;
+  std::string resume_from;
+  std::string telemetry_file;
+
+  static SearchParams FromFlags();
+
+  // 按每一层选出的结点总数量计算两种选择方式各自的数量和祖先配额
+  void SetTotalKeep(unsigned total_keep);
+};
 
-void PrepareFlags() {
-  g_quality_keep_count = FLAGS_total_keep * (1. - FLAGS_score_keep_ratio);
-  g_score_keep_count = FLAGS_total_keep - g_quality_keep_count;
+SearchParams SearchParams::FromFlags() {
+  SearchParams res;
+  res.score_keep_ratio = FLAGS_score_keep_ratio;
+  res.score_height_quota = FLAGS_score_height_quota;
+  res.quality_height_quota = FLAGS_quality_height_quota;
 
   for (auto part : absl::StrSplit(FLAGS_score_parent_quota, ",")) {
     float x;
-    if (absl::SimpleAtof(part, &x))
-      g_score_parent_quota.push_back(g_score_keep_count * x);
+    if (absl::SimpleAtof(part, &x)) res.score_parent_ratio.push_back(x);
   }
   for (auto part : absl::StrSplit(FLAGS_quality_parent_quota, ",")) {
     float x;
-    if (absl::SimpleAtof(part, &x))
-      g_quality_parent_quota.push_back(g_quality_keep_count * x);
+    if (absl::SimpleAtof(part, &x)) res.quality_parent_ratio.push_back(x);
   }
+  res.total_keep = FLAGS_total_keep;
+  res.time_budget = FLAGS_time_budget;
+  res.SetTotalKeep(res.total_keep);
+
+  res.ignore_score_threshold = FLAGS_ignore_score_threshold;
+  res.ignore_height_threshold = FLAGS_ignore_height_threshold;
 
+  res.abort_threshold.assign(kSteps, 0);
   for (unsigned i = 0; auto part : absl::StrSplit(FLAGS_abort_threshold, ",")) {
-    static_cast<void>(absl::SimpleAtoi(part, &g_abort_threshold[i]));
+    static_cast<void>(absl::SimpleAtoi(part, &res.abort_threshold[i]));
     if (++i >= kSteps) break;
   }
+
+  res.stream_keep_factor = FLAGS_stream_keep_factor;
+  if (res.stream_keep_factor != 0 && res.stream_keep_factor < 1) {
+    fprintf(stderr, "Invalid --stream_keep_factor=%g\n",
+            res.stream_keep_factor);
+    exit(1);
+  }
+  res.lookahead_factor = FLAGS_lookahead_factor;
+  res.lookahead_depth = FLAGS_lookahead_depth;
+  if (res.lookahead_depth < 1 || res.lookahead_depth > kMaxLookaheadDepth) {
+    fprintf(stderr, "Invalid --lookahead_depth=%u\n", res.lookahead_depth);
+    exit(1);
+  }
+  res.quality_weights = QualityWeights::FromFlags();
+  res.checkpoint_file = FLAGS_checkpoint_file;
+  res.checkpoint_interval = FLAGS_checkpoint_interval;
+  res.resume_from = FLAGS_resume_from;
+  res.telemetry_file = FLAGS_telemetry_file;
+  return res;
+}
+
+void SearchParams::SetTotalKeep(unsigned total_keep) {
+  quality_keep_count = total_keep * (1. - score_keep_ratio);
+  score_keep_count = total_keep - quality_keep_count;
+  score_parent_quota.clear();
+  for (float x : score_parent_ratio)
+    score_parent_quota.push_back(score_keep_count * x);
+  quality_parent_quota.clear();
+  for (float x : quality_parent_ratio)
+    quality_parent_quota.push_back(quality_keep_count * x);
 }
 
 struct State;
-using StatePtr = boost::intrusive_ptr<State>;
+// State都分配在Arena里（见StateArenas），不单独释放
+using StatePtr = State*;
 
 struct State {
   Situation situ;                                   // 当前局面
-  int quality{situ.Quality()};                      // 缓存situ.Quality()
+  int quality{0};                                   // 缓存situ.Quality()
   unsigned occupied_height{situ.OccupiedHeight()};  // 缓存situ.OccupiedHeight()
-  StatePtr parent;                                  // 父结点
-  ActionVector actions;                             // 操作序列
+  uint32_t parent{SearchTree::kNone};  // 父结点在搜索树上一层中的下标
+  uint32_t node{SearchTree::kNone};    // 被选中后在搜索树中的下标
+  BrickStatus landing{};  // 这一步方块的落点，操作序列在MakeSolution中才生成
+  int lookahead{0};       // 向后看能达到的最高quality，只在选择时临时使用
+};
 
-  // boost::intrusive_ptr使用的引用计数
-  mutable std::atomic<unsigned> ref_cnt_{0};
+// 管理所有State的内存，按代（即步数）整体分配和回收
+// 每个线程为每一代各有一个Arena。回溯所需的信息都记录在SearchTree里，
+// 所以一代结点在展开完、选出下一代以后就没有被引用的了，整体释放。
+// 任何时候最多只有两代结点存活，因此两组Arena交替使用即可。
+class StateArenas {
+ public:
+  explicit StateArenas(unsigned threads) {
+    for (auto& arenas : arenas_) arenas = std::vector<Arena>(threads);
+  }
 
-  friend void intrusive_ptr_add_ref(const State* x) {
-    x->ref_cnt_.fetch_add(1, std::memory_order_acq_rel);
+  StatePtr NewInitialState(const QualityWeights& weights) {
+    StatePtr state = arenas_[0][0].New<State>();
+    state->quality = state->situ.Quality(weights);
+    return state;
   }
-  friend void intrusive_ptr_release(const State* x) {
-    if (x->ref_cnt_.fetch_sub(1, std::memory_order_acq_rel) - 1 == 0) delete x;
+
+  // 当前线程用来分配第step步结点（即situ.step_ == step）的Arena
+  Arena* ArenaFor(uint32_t step) {
+    return &arenas_[step % 2][ThreadPool::CurrentIndex()];
   }
+
+  // 第step步的结点已经不再被引用，整体释放
+  void Release(uint32_t step) {
+    for (Arena& arena : arenas_[step % 2]) arena.Reset();
+  }
+
+ private:
+  std::vector<Arena> arenas_[2];
 };
 
-uint64_t FastHashBricks(const Situation& situ) {
-  uint64_t h = 0;
-#pragma unroll
-  for (uint64_t x : situ.row_4_) h = (h << kW | h >> (64 - kW)) ^ x;
-  return h;
+// ChooseForNextStep中两种选择方式的key
+auto ScoreKey(const Situation& situ, int quality) {
+  // 每次消除平均得分
+  return std::make_tuple(uint64_t(situ.score_) * 10000 /
+                             std::max<uint32_t>(situ.collapse_count_, 1),
+                         situ.score_, quality);
 }
 
-struct BricksHasher {
-  size_t operator()(const Situation& situ) const {
-    size_t h = 0;
-    for (auto v : situ.row_4_) HashCombine(h, v);
-    return h;
-  }
+auto QualityKey(const Situation& situ, int quality) {
+  return std::make_pair(quality, situ.score_);
+}
 
-  uint64_t operator()(const StatePtr& state_ptr) const {
-    return (*this)(state_ptr->situ);
-  }
+// 开启--lookahead_factor时代替QualityKey
+// 只看下一步的最高quality太偏重于眼前，与当前的quality相加作为平滑。
+// 没有向后看的结点lookahead为INT_MIN，排在所有向后看过的之后
+auto LookaheadKey(const State& state) {
+  return std::make_tuple(int64_t(state.quality) + state.lookahead,
+                         state.quality, state.situ.score_);
+}
+
+// 选全局最优时用的key
+auto GlobalBestKey(const Situation& situ, int quality) {
+  return std::make_tuple(situ.score_, situ.step_, quality);
+}
+
+// 按GlobalBestKey比较，相等时按BricksComp产生确定性的结果
+bool BetterGlobalBest(const State& a, const State& b);
+
+// 子结点的最高分和最高高度，用于剪枝
+struct ChildLimits {
+  uint32_t max_score = 0;
+  uint32_t max_height = 0;
 };
 
-struct BricksEqual {
-  bool operator()(const Situation& a, const Situation& b) const {
-    return a.BricksEqual(b);
+uint64_t HashBricks(const Situation& situ) {
+  size_t h = 0;
+  for (auto v : situ.row_4_) HashCombine(h, v);
+  return h;
+}
+
+// 开放寻址的哈希表，只保存下标，用于去重
+// 每一步开始时清空，但已经分配的容量保留下来
+class DedupTable {
+ public:
+  static constexpr uint32_t kEmpty = uint32_t(-1);
+
+  // 准备插入最多n个元素
+  void Reset(size_t n) {
+    size_t capacity = std::bit_ceil(std::max<size_t>(n * 2, 64));
+    if (capacity > slots_.size()) {
+      slots_.assign(capacity, kEmpty);
+    } else {
+      std::fill(slots_.begin(), slots_.end(), kEmpty);
+    }
   }
-  bool operator()(const StatePtr& a, const StatePtr& b) const {
-    return (*this)(a->situ, b->situ);
+
+  // 查找hash相同且equal(下标)为真的元素，返回它所在的位置
+  // 如果没有，返回应该插入的空位置
+  template <typename Equal>
+  uint32_t& Find(uint64_t hash, Equal equal) {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      uint32_t& slot = slots_[i];
+      if (slot == kEmpty || equal(slot)) return slot;
+    }
   }
+
+ private:
+  std::vector<uint32_t> slots_;
 };
 
 // 收集下一层的结点，并进行去重
+// 工作线程各自把子结点按hash分区暂存起来，不加锁；之后按分区并行去重，
+// 只有胜出的才生成State并计算quality等
+// 开启流式选择时，每个分区只为按两种key各排在前面的若干个生成State。
+// 这是有损的：MoveTopN的祖先配额和高度配额会跳过一些结点，选到比各分区
+// 份额更靠后的结点，而它们可能已经被截掉了，所以结果会随份额变化。
+// 截取是在去重时做的，所有子结点仍然先全部暂存，峰值内存并不减少，
+// 省下的只是State的生成和MoveTopN的排序
 class StateCollector {
  public:
-  void Add(StatePtr&& state_ptr) {
-    auto& situ = state_ptr->situ;
-    size_t i = FastHashBricks(situ) % kN;
-    std::lock_guard lock(mutexes_[i]);
-    auto& set = sets_[i];
-    auto better_than = [](const Situation& a, const Situation& b) {
-      return (a.score_ > b.score_) ||
-             (a.score_ == b.score_ && a.collapse_count_ < b.collapse_count_);
-    };
-    auto [it, ok] = set.insert(state_ptr);
-    if (!ok) {
-      if (better_than(state_ptr->situ, (*it)->situ))
-        const_cast<StatePtr&>(*it) = std::move(state_ptr);
-    }
+  StateCollector(unsigned threads, const SearchParams& params)
+      : params_(params),
+        staged_(threads),
+        expand_counters_(threads),
+        streaming_(params.stream_keep_factor > 0) {}
+
+  // 在工作线程中调用
+  void Stage(const Situation& situ, uint32_t parent, BrickStatus landing) {
+    uint64_t hash = HashBricks(situ);
+    // 高位用于分区，低位留给DedupTable
+    size_t partition = hash >> 32 & (kPartitions - 1);
+    staged_[ThreadPool::CurrentIndex()][partition].push_back(
+        {hash, situ, parent, landing});
   }
 
-  void MoveTo(std::vector<StatePtr>* res) {
-    for (auto& set : sets_) {
-      for (auto& item : set) res->push_back(std::move(item));
-      set.clear();
+  // 在工作线程中调用，记录FindAllMoves找到的和禁止消除跳过的子结点数
+  void CountExpanded(size_t generated, size_t gated) {
+    ExpandCounters& counters = expand_counters_[ThreadPool::CurrentIndex()];
+    counters.generated += generated;
+    counters.gated += gated;
+  }
+
+  // 在主线程中调用，结果按分区顺序放入res，与线程调度无关
+  // 返回的是去重后的全部子结点（包括没有生成State的）的最高分和最高高度
+  // 这一步的结点数量统计累加到stats中
+  ChildLimits MoveTo(ThreadPool* thread_pool, StateArenas* arenas,
+                     uint32_t step, std::vector<StatePtr>* res,
+                     StepStats* stats) {
+    // 开启--time_budget时选出的数量每一步都可能不同
+    score_capacity_ = std::ceil(params_.stream_keep_factor *
+                                params_.score_keep_count / kPartitions);
+    quality_capacity_ = std::ceil(params_.stream_keep_factor *
+                                  params_.quality_keep_count / kPartitions);
+    unsigned partitions[kPartitions];
+    for (unsigned i = 0; i < kPartitions; ++i) partitions[i] = i;
+    thread_pool->SyncRunSpan(std::span<unsigned>(partitions),
+                             [&](unsigned partition) {
+      Merge(partition, arenas->ArenaFor(step + 1));
+    });
+
+    ChildLimits limits;
+    for (unsigned i = 0; i < kPartitions; ++i) {
+      stats->collected += results_[i].size();
+      res->insert(res->end(), results_[i].begin(), results_[i].end());
+      results_[i].clear();
+      limits.max_score = std::max(limits.max_score, limits_[i].max_score);
+      limits.max_height = std::max(limits.max_height, limits_[i].max_height);
+      stats->staged += counts_[i].staged;
+      stats->unique += counts_[i].unique;
+      stats->not_ok += counts_[i].not_ok;
+    }
+    for (ExpandCounters& counters : expand_counters_) {
+      stats->generated += std::exchange(counters.generated, 0);
+      stats->gated += std::exchange(counters.gated, 0);
     }
+    return limits;
   }
 
  private:
-  static constexpr size_t kN = 17;
-  absl::flat_hash_set<StatePtr, BricksHasher, BricksEqual> sets_[kN];
-  std::mutex mutexes_[kN];
-};
-
-void SearchFrom(StatePtr& state_ptr, StateCollector* res);
-Solution MakeSolution(State* final_state,
-                      const std::vector<unsigned>& score_by_step);
+  struct StagedState {
+    uint64_t hash;
+    Situation situ;
+    uint32_t parent;
+    BrickStatus landing;
+  };
 
-void ChooseForNextStep(std::vector<StatePtr>&& orig,
-                       std::vector<StatePtr>* res);
+  struct alignas(64) ExpandCounters {
+    uint64_t generated = 0;
+    uint64_t gated = 0;
+  };
 
-// 算法主入口
-Solution Solve() {
-  PrepareFlags();
+  // 每个分区去重前后的数量
+  struct PartitionCounts {
+    uint64_t staged;
+    uint64_t unique;
+    uint64_t not_ok;
+  };
 
-  StatePtr initial_state{new State};
+  static bool BetterThan(const StagedState& a, const StagedState& b) {
+    if (a.situ.score_ != b.situ.score_) return a.situ.score_ > b.situ.score_;
+    if (a.situ.collapse_count_ != b.situ.collapse_count_)
+      return a.situ.collapse_count_ < b.situ.collapse_count_;
+    // 保证结果与线程调度无关
+    return a.parent < b.parent;
+  }
 
-  std::vector<StatePtr> step_bests{initial_state};
-  StatePtr global_best{initial_state};
+  void Merge(unsigned partition, Arena* arena);
 
-  ThreadPool thread_pool;
+  // 在candidates中选出按key_func排在前面的n个，标记在keep中
+  template <typename Callback>
+  static void SelectTopN(std::vector<uint32_t>& candidates, size_t n,
+                         std::span<const Situation> situs,
+                         std::span<const int> qualities, char* keep,
+                         Callback key_func);
 
-  std::vector<unsigned> score_by_step;
-  auto start_time = std::chrono::steady_clock::now();
+ private:
+  static constexpr size_t kPartitions = 64;
+  const SearchParams& params_;
+  std::vector<std::array<std::vector<StagedState>, kPartitions>> staged_;
+  std::vector<ExpandCounters> expand_counters_;
+  // 流式选择时每个分区按两种key各保留的数量
+  bool streaming_;
+  size_t score_capacity_ = 0;
+  size_t quality_capacity_ = 0;
+  DedupTable tables_[kPartitions];
+  std::vector<StatePtr> results_[kPartitions];
+  ChildLimits limits_[kPartitions];
+  PartitionCounts counts_[kPartitions];
+};
 
-  for (uint32_t step = 0; step < kSteps; ++step) {
-    StateCollector collector;
+template <typename Callback>
+void StateCollector::SelectTopN(std::vector<uint32_t>& candidates, size_t n,
+                                std::span<const Situation> situs,
+                                std::span<const int> qualities, char* keep,
+                                Callback key_func) {
+  if (candidates.size() > n) {
+    std::nth_element(candidates.begin(), candidates.begin() + n,
+                     candidates.end(), [&](uint32_t a, uint32_t b) {
+                       auto u = key_func(situs[a], qualities[a]);
+                       auto v = key_func(situs[b], qualities[b]);
+                       if (u != v) return u > v;
+                       // 与MoveTopN的排序一致
+                       return situs[a].BricksComp(situs[b]) > 0;
+                     });
+  }
+  for (size_t i = 0; i < std::min(n, candidates.size()); ++i)
+    keep[candidates[i]] = true;
+}
 
-    for (StatePtr& state_ptr : step_bests) {
-      if (state_ptr->situ.step_ != step) {
-        fprintf(stderr, "Step error ! %u != %u\n", state_ptr->situ.step_, step);
-        return {};
+void StateCollector::Merge(unsigned partition, Arena* arena) {
+  size_t total = 0;
+  for (auto& staged : staged_) total += staged[partition].size();
+
+  thread_local std::vector<const StagedState*> winners;
+  winners.clear();
+  DedupTable& table = tables_[partition];
+  table.Reset(total);
+  for (auto& staged : staged_) {
+    for (const StagedState& item : staged[partition]) {
+      uint32_t& slot = table.Find(item.hash, [&](uint32_t i) {
+        return winners[i]->hash == item.hash &&
+               winners[i]->situ.BricksEqual(item.situ);
+      });
+      if (slot == DedupTable::kEmpty) {
+        slot = winners.size();
+        winners.push_back(&item);
+      } else if (BetterThan(item, *winners[slot])) {
+        winners[slot] = &item;
       }
     }
+  }
 
-    thread_pool.SyncRunSpan(std::span(step_bests), [&](StatePtr& state_ptr) {
-      SearchFrom(state_ptr, &collector);
-    });
+  // 只对胜出的计算quality、高度和IsOk
+  thread_local std::vector<Situation> situs;
+  thread_local std::vector<int> qualities;
+  thread_local std::vector<unsigned> occupied_heights;
+  thread_local absl::InlinedVector<bool, 64> oks;
+  situs.clear();
+  for (const StagedState* item : winners) situs.push_back(item->situ);
+  qualities.resize(situs.size());
+  occupied_heights.resize(situs.size());
+  oks.resize(situs.size());
+  EvaluateBatch(situs, params_.quality_weights, qualities.data(),
+                occupied_heights.data(), oks.data());
+
+  ChildLimits& limits = limits_[partition];
+  limits = {};
+  counts_[partition] = {total, winners.size(), 0};
+  for (size_t i = 0; i < winners.size(); ++i) {
+    if (!oks[i]) {
+      ++counts_[partition].not_ok;
+      continue;
+    }
+    limits.max_score = std::max(limits.max_score, situs[i].score_);
+    limits.max_height = std::max(limits.max_height, occupied_heights[i]);
+  }
 
-    std::vector<StatePtr> next_step_bests;
-    collector.MoveTo(&next_step_bests);
-
-    auto global_best_key_func = [](const State& state) {
-      return std::make_tuple(state.situ.score_, state.situ.step_,
-                             state.quality);
-    };
-    auto global_best_key = global_best_key_func(*global_best);
-    for (StatePtr& state_ptr : next_step_bests) {
-      auto new_key = global_best_key_func(*state_ptr);
-      if (new_key > global_best_key ||
-          (new_key == global_best_key &&
-           state_ptr->situ.BricksComp(global_best->situ) > 0)) {
-        global_best = state_ptr;
-        global_best_key = new_key;
+  // keep[i]表示是否为第i个生成State
+  thread_local std::vector<char> keep;
+  keep.assign(oks.begin(), oks.end());
+  if (streaming_) {
+    // 本分区的最高分、最高高度不超过全局的，用它们提前做
+    // ChooseForNextStep中的剪枝是安全的
+    thread_local std::vector<uint32_t> candidates;
+    candidates.clear();
+    uint32_t best = DedupTable::kEmpty;
+    bool best_cut = false;  // best是否被下面的剪枝剪掉了
+    for (uint32_t i = 0; i < winners.size(); ++i) {
+      if (!keep[i]) continue;
+      keep[i] = false;
+      bool cut =
+          situs[i].score_ + params_.ignore_score_threshold < limits.max_score ||
+          occupied_heights[i] + params_.ignore_height_threshold <
+              limits.max_height;
+      // 本分区的最优结点可能是全局最优，必须保留，即使它被剪枝剪掉
+      // （比如消行以后高度太低）
+      if (best == DedupTable::kEmpty) {
+        best = i;
+        best_cut = cut;
+      } else if (auto u = GlobalBestKey(situs[i], qualities[i]),
+                 v = GlobalBestKey(situs[best], qualities[best]);
+                 u > v || (u == v && situs[i].BricksComp(situs[best]) > 0)) {
+        best = i;
+        best_cut = cut;
       }
+      if (!cut) candidates.push_back(i);
+    }
+    if (best != DedupTable::kEmpty) {
+      keep[best] = true;
+      if (best_cut) candidates.push_back(best);
     }
+    SelectTopN(candidates, score_capacity_, situs, qualities, keep.data(),
+               ScoreKey);
+    SelectTopN(candidates, quality_capacity_, situs, qualities, keep.data(),
+               QualityKey);
+  }
 
-    ChooseForNextStep(std::move(next_step_bests), &step_bests);
+  auto& results = results_[partition];
+  for (size_t i = 0; i < winners.size(); ++i) {
+    // 按IsOk剪枝
+    if (!keep[i]) continue;
+    const StagedState& winner = *winners[i];
+    results.push_back(arena->New<State>(situs[i], qualities[i],
+                                        occupied_heights[i], winner.parent,
+                                        SearchTree::kNone, winner.landing));
+  }
 
-    unsigned current_best_score = global_best->situ.score_;
-    if (current_best_score < g_abort_threshold[step]) return Solution();
-    score_by_step.push_back(current_best_score);
+  for (auto& staged : staged_) staged[partition].clear();
+}
+
+void SearchFrom(StatePtr state_ptr, RouteCache* route_cache,
+                StateCollector* res);
+int LookaheadQuality(const Situation& situ, int quality, unsigned depth,
+                     const QualityWeights& weights, RouteCache* route_cache);
+Solution MakeSolution(const SearchTree& tree, const State& final_state,
+                      const std::vector<unsigned>& score_by_step);
 
-    if (step != 0 && step % 100 == 0) {
-      rusage ru;
-      getrusage(RUSAGE_SELF, &ru);
+void ChooseForNextStep(const SearchParams& params, ThreadPool& thread_pool,
+                       RouteCache* route_cache, const SearchTree& tree,
+                       std::vector<StatePtr>&& orig, const ChildLimits& limits,
+                       std::vector<StatePtr>* res, StepStats* stats);
+
+// 每隔这么多步清理一次搜索树
+constexpr unsigned kPruneInterval = 16;
+
+// 展开时每批交给线程池的结点数
+// 一个结点展开得很快，逐个调度的话线程间争抢的开销就显得多了
+constexpr size_t kExpandBatchSize = 16;
+
+// 采集基准测试样本时，每隔这么多步采集一次，每种高度最多取这么多个
+constexpr unsigned kCorpusInterval = 250;
+constexpr unsigned kCorpusPerHeight = 4;
+
+bool SaveSnapshot(const std::string& path, const SearchTree& tree,
+                  std::span<const StatePtr> step_bests,
+                  const State& global_best,
+                  const std::vector<unsigned>& score_by_step);
+bool LoadSnapshot(const std::string& path, SearchTree* tree,
+                  StateArenas* arenas, std::vector<StatePtr>* step_bests,
+                  State* global_best, std::vector<unsigned>* score_by_step);
+
+// 一个配置的搜索过程，每次推进一步
+// 多个配置可以共用一个线程池：先把各配置这一步的批合在一起展开，
+// 再分别调用FinishStep
+class Search {
+ public:
+  // corpus不为nullptr时，采集基准测试样本追加到其中
+  Search(std::string name, const SearchParams& params, ThreadPool* thread_pool,
+         RouteCache* route_cache, std::vector<Situation>* corpus)
+      : name_(std::move(name)),
+        params_(params),
+        thread_pool_(thread_pool),
+        route_cache_(route_cache),
+        corpus_(corpus),
+        scheduler_(params_.time_budget, params_.total_keep),
+        arenas_(thread_pool->size()),
+        collector_(thread_pool->size(), params_) {}
+
+  // 从头开始或者从快照恢复，失败返回false
+  bool Init();
+
+  // 搜索结束（走完或者中途放弃）
+  bool done() const { return step_ >= kSteps || aborted_; }
+
+  // 这一步要展开的结点，每kExpandBatchSize个一批追加到batches中
+  void AppendBatches(std::vector<std::pair<Search*, std::span<StatePtr>>>*
+                         batches);
+
+  // 展开一批结点，在工作线程中调用
+  void ExpandBatch(std::span<StatePtr> batch) {
+    for (StatePtr state_ptr : batch)
+      SearchFrom(state_ptr, route_cache_, &collector_);
+  }
+
+  // 所有批都展开以后，选出下一步的结点
+  // expand_us是展开用的时间，用于统计
+  void FinishStep(uint64_t expand_us);
+
+  Solution Result() const;
+
+ private:
+  void PruneTree();
+  void SaveCheckpoint();
+  void PrintProgress();
+  void CaptureCorpus();
+
+ private:
+  std::string name_;
+  SearchParams params_;
+  ThreadPool* thread_pool_;
+  RouteCache* route_cache_;
+  std::vector<Situation>* corpus_;
+  TelemetryWriter telemetry_;
+  BeamScheduler scheduler_;
+
+  StateArenas arenas_;
+  SearchTree tree_;
+  // 各步复用同一个collector，以便保留已分配的内存
+  StateCollector collector_;
+  std::vector<StatePtr> step_bests_;
+  State global_best_;
+  std::vector<unsigned> score_by_step_;
+
+  uint32_t step_ = 0;
+  uint32_t start_step_ = 0;
+  bool aborted_ = false;
+  std::chrono::steady_clock::time_point start_time_;
+};
+
+bool Search::Init() {
+  if (params_.resume_from.empty()) {
+    StatePtr initial_state = arenas_.NewInitialState(params_.quality_weights);
+    initial_state->node = tree_.Add(0, SearchTree::kNone, {});
+    step_bests_.push_back(initial_state);
+    global_best_ = *initial_state;
+  } else if (!LoadSnapshot(params_.resume_from, &tree_, &arenas_,
+                           &step_bests_, &global_best_, &score_by_step_)) {
+    fprintf(stderr, "Failed to load snapshot %s\n",
+            params_.resume_from.c_str());
+    return false;
+  }
+  if (!params_.telemetry_file.empty() &&
+      !telemetry_.Open(params_.telemetry_file))
+    return false;
+  step_ = start_step_ = score_by_step_.size();
+  start_time_ = std::chrono::steady_clock::now();
+  scheduler_.Start();
+  return true;
+}
+
+void Search::AppendBatches(
+    std::vector<std::pair<Search*, std::span<StatePtr>>>* batches) {
+  for (StatePtr& state_ptr : step_bests_) {
+    if (state_ptr->situ.step_ != step_) {
+      fprintf(stderr, "Step error ! %u != %u\n", state_ptr->situ.step_, step_);
+      aborted_ = true;
+      return;
+    }
+  }
+
+  for (size_t i = 0; i < step_bests_.size(); i += kExpandBatchSize)
+    batches->emplace_back(
+        this, std::span(step_bests_)
+                  .subspan(i, std::min<size_t>(kExpandBatchSize,
+                                               step_bests_.size() - i)));
+}
+
+void Search::FinishStep(uint64_t expand_us) {
+  uint32_t step = step_;
+  ThreadPool& thread_pool = *thread_pool_;
+  StepStats stats;
+  stats.step = step;
+  stats.expand_us = expand_us;
+  Stopwatch stopwatch;
+
+  // 按时间预算决定这一步选出多少结点
+  if (scheduler_.enabled())
+    params_.SetTotalKeep(
+        scheduler_.NextKeep(step_bests_.size(), score_by_step_));
+  stats.total_keep = params_.score_keep_count + params_.quality_keep_count;
+
+  std::vector<StatePtr> next_step_bests;
+  ChildLimits limits = collector_.MoveTo(&thread_pool, &arenas_, step,
+                                         &next_step_bests, &stats);
+  stats.collect_us = stopwatch.Lap();
+
+  // 可能的新全局最优
+  StatePtr new_global_best = ParallelReduce(
+      thread_pool, next_step_bests.size(), StatePtr(nullptr),
+      [&](size_t begin, size_t end) {
+        StatePtr best = nullptr;
+        for (size_t i = begin; i < end; ++i)
+          if (!best || BetterGlobalBest(*next_step_bests[i], *best))
+            best = next_step_bests[i];
+        return best;
+      },
+      [](StatePtr a, StatePtr b) {
+        return !a || (b && BetterGlobalBest(*b, *a)) ? b : a;
+      });
+  if (new_global_best && !BetterGlobalBest(*new_global_best, global_best_))
+    new_global_best = nullptr;
+  stats.global_best_us = stopwatch.Lap();
+
+  ChooseForNextStep(params_, thread_pool, route_cache_, tree_,
+                    std::move(next_step_bests), limits, &step_bests_, &stats);
+  stats.choose_us = stopwatch.Lap();
+
+  // 选出的结点记录到搜索树中，之后这一步之前的结点就可以释放了
+  auto add_to_tree = [&](StatePtr state_ptr) {
+    state_ptr->node =
+        tree_.Add(step + 1, state_ptr->parent, state_ptr->landing);
+  };
+  for (StatePtr state_ptr : step_bests_) add_to_tree(state_ptr);
+  if (corpus_ && (step + 1) % kCorpusInterval == 0) CaptureCorpus();
+  if (new_global_best) {
+    if (new_global_best->node == SearchTree::kNone)
+      add_to_tree(new_global_best);
+    global_best_ = *new_global_best;
+  }
+  arenas_.Release(step);
+
+  // 最后一步之后没有可以继续的了，不保存，以免覆盖上一个可以恢复的快照
+  bool checkpoint = !params_.checkpoint_file.empty() &&
+                    params_.checkpoint_interval != 0 &&
+                    (step + 1) % params_.checkpoint_interval == 0 &&
+                    step + 1 < kSteps;
+
+  if (step % kPruneInterval == 0 || checkpoint) PruneTree();
+
+  unsigned current_best_score = global_best_.situ.score_;
+  aborted_ = current_best_score < params_.abort_threshold[step];
+  if (!aborted_) {
+    score_by_step_.push_back(current_best_score);
+    step_ = step + 1;
+    if (checkpoint) SaveCheckpoint();
+  }
+
+  if (telemetry_.is_open()) {
+    stats.tree_us = stopwatch.Lap();
+    stats.best_score = current_best_score;
+    telemetry_.Write(stats);
+  }
+  if (aborted_) return;
+  if (step != 0 && step % 100 == 0) PrintProgress();
+}
 
-      uint32_t cpu_ms = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
-      uint32_t wall_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                             std::chrono::steady_clock::now() - start_time)
-                             .count();
-      fprintf(
-          stderr,
+void Search::PruneTree() {
+  for (StatePtr state_ptr : step_bests_)
+    tree_.Keep(step_ + 1, state_ptr->node);
+  tree_.Keep(global_best_.situ.step_, global_best_.node);
+  tree_.Prune();
+  for (StatePtr state_ptr : step_bests_)
+    state_ptr->node = tree_.NewIndex(step_ + 1, state_ptr->node);
+  global_best_.node =
+      tree_.NewIndex(global_best_.situ.step_, global_best_.node);
+}
+
+void Search::SaveCheckpoint() {
+  std::string path = absl::StrReplaceAll(
+      params_.checkpoint_file, {{"{step}", std::to_string(step_)}});
+  if (SaveSnapshot(path, tree_, step_bests_, global_best_, score_by_step_))
+    fprintf(stderr, "%sSaved snapshot of step %u to %s\n", name_.c_str(),
+            step_, path.c_str());
+}
+
+void Search::PrintProgress() {
+  uint32_t step = step_ - 1;
+
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  uint32_t cpu_ms = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
+  uint32_t wall_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - start_time_)
+                         .count();
+  // 本次运行（恢复快照的话是恢复以后）走过的步数
+  uint32_t steps_run = step + 1 - start_step_;
+  fprintf(stderr,
           "==============================================\n"
-          "Step %u (abort threshold %u; estimated final score %u; "
+          "%sStep %u (abort threshold %u; estimated final score %u; "
           "CPU parallel %.1f; %u ms / step; ETA %u s of %u s):\n%s",
-          step, g_abort_threshold[step],
-          uint32_t(uint64_t(global_best->situ.score_) * kSteps / (step + 1)),
-          float(cpu_ms) / float(wall_ms), wall_ms / (step + 1),
-          uint32_t(uint64_t(wall_ms) * (kSteps - step - 1) / (step + 1) / 1000),
-          uint32_t(uint64_t(wall_ms) * kSteps / (step + 1) / 1000),
-          global_best->situ.DebugString().c_str());
+          name_.c_str(), step, params_.abort_threshold[step],
+          uint32_t(uint64_t(global_best_.situ.score_) * kSteps / (step + 1)),
+          float(cpu_ms) / float(wall_ms), wall_ms / steps_run,
+          uint32_t(uint64_t(wall_ms) * (kSteps - step - 1) / steps_run / 1000),
+          uint32_t(uint64_t(wall_ms) * (kSteps - start_step_) / steps_run /
+                   1000),
+          global_best_.situ.DebugString().c_str());
+
+  if (scheduler_.enabled())
+    fprintf(stderr, "Beam width %u (time budget %.0f s)\n",
+            params_.score_keep_count + params_.quality_keep_count,
+            params_.time_budget);
+
+  if (FLAGS_route_cache_size) {
+    auto stats = route_cache_->GetStats();
+    fprintf(stderr, "Route cache: %zu entries, hit rate %.1f%%\n",
+            stats.entries,
+            100. * stats.hits /
+                std::max<uint64_t>(stats.hits + stats.misses, 1));
+  }
+}
+
+Solution Search::Result() const {
+  if (aborted_) return Solution();
+  Solution res = MakeSolution(tree_, global_best_, score_by_step_);
+
+  // 从头重放一遍，确认操作序列确实得到这个分数
+  Situation situ;
+  if (!ReplaySolution(res.actions, &situ) ||
+      !situ.BricksEqual(res.final_situ) ||
+      situ.score_ != res.final_situ.score_) {
+    fprintf(stderr, "%sFinal verification failed: score %u, expected %u\n",
+            name_.c_str(), situ.score_, res.final_situ.score_);
+    exit(1);
+  }
+  return res;
+}
+
+// 每种高度取排在最前面的几个，使样本覆盖不同高度的局面
+void Search::CaptureCorpus() {
+  unsigned count[kH + 1]{};
+  for (StatePtr state_ptr : step_bests_)
+    if (count[state_ptr->occupied_height]++ < kCorpusPerHeight)
+      corpus_->push_back(state_ptr->situ);
+}
+
+// 整个进程共用、不属于某一组参数的flags，不能在config中覆盖
+constexpr std::string_view kProcessFlags[] = {
+    "threads", "pin_threads",    "route_cache_size",
+    "verify",  "capture_corpus", "configs",
+};
+
+bool IsProcessFlag(std::string_view name) {
+  for (std::string_view flag : kProcessFlags) {
+    // 布尔flag也可以写成--no<名字>
+    if (name == flag || (name.starts_with("no") && name.substr(2) == flag))
+      return true;
+  }
+  return false;
+}
+
+// 在命令行flags的基础上覆盖config中的flags，得到一组参数
+SearchParams ParseConfig(const std::string& config) {
+  gflags::FlagSaver saver;
+  for (auto arg : absl::StrSplit(config, ' ', absl::SkipWhitespace())) {
+    std::string name, value;
+    if (arg.size() > 2 && arg.substr(0, 2) == "--") {
+      auto pos = arg.find('=');
+      name = std::string(arg.substr(2, pos - 2));
+      value = pos == arg.npos ? "true" : std::string(arg.substr(pos + 1));
     }
+    if (IsProcessFlag(name)) {
+      fprintf(stderr, "Flag --%s cannot be set in config: %s\n", name.c_str(),
+              config.c_str());
+      exit(1);
+    }
+    if (name.empty() ||
+        gflags::SetCommandLineOption(name.c_str(), value.c_str()).empty()) {
+      fprintf(stderr, "Invalid flag in config: %s\n",
+              std::string(arg).c_str());
+      exit(1);
+    }
+  }
+  return SearchParams::FromFlags();
+}
+
+// 算法主入口
+Solution Solve() { return std::move(SolveConfigs({""})[0]); }
+
+std::vector<Solution> SolveConfigs(const std::vector<std::string>& configs) {
+  if (FLAGS_verify == "all") {
+    g_verify_mode = VerifyMode::kAll;
+  } else if (FLAGS_verify == "sample") {
+    g_verify_mode = VerifyMode::kSample;
+  } else if (FLAGS_verify == "final") {
+    g_verify_mode = VerifyMode::kFinal;
+  } else {
+    fprintf(stderr, "Invalid --verify=%s\n", FLAGS_verify.c_str());
+    exit(1);
+  }
+
+  ThreadPool thread_pool(FLAGS_threads, FLAGS_pin_threads);
+  // 落点与参数无关，所有配置共用
+  RouteCache route_cache(FLAGS_route_cache_size);
+  std::vector<Situation> corpus;
+  bool capture = !FLAGS_capture_corpus.empty();
+
+  std::vector<std::unique_ptr<Search>> searches;
+  for (size_t i = 0; i < configs.size(); ++i) {
+    SearchParams params = ParseConfig(configs[i]);
+    for (std::string* path : {&params.checkpoint_file, &params.telemetry_file})
+      *path = absl::StrReplaceAll(*path, {{"{config}", std::to_string(i)}});
+    std::string name =
+        configs.size() > 1 ? absl::StrCat("[config ", i, "] ") : "";
+    auto& search = searches.emplace_back(std::make_unique<Search>(
+        std::move(name), params, &thread_pool, &route_cache,
+        capture ? &corpus : nullptr));
+    if (!search->Init()) exit(1);
+  }
+
+  std::vector<std::pair<Search*, std::span<StatePtr>>> batches;
+  for (;;) {
+    // 所有配置这一步的结点一起展开
+    batches.clear();
+    for (auto& search : searches)
+      if (!search->done()) search->AppendBatches(&batches);
+    if (batches.empty()) break;
+    Stopwatch stopwatch;
+    thread_pool.SyncRunSpan(
+        std::span(batches), [](std::pair<Search*, std::span<StatePtr>> batch) {
+          batch.first->ExpandBatch(batch.second);
+        });
+
+    uint64_t expand_us = stopwatch.Lap();
+
+    for (auto& search : searches)
+      if (!search->done()) search->FinishStep(expand_us);
+  }
+
+  if (capture) {
+    if (SaveCorpus(FLAGS_capture_corpus, corpus))
+      fprintf(stderr, "Saved %zu situations to %s\n", corpus.size(),
+              FLAGS_capture_corpus.c_str());
   }
 
-  return MakeSolution(global_best.get(), score_by_step);
+  std::vector<Solution> res;
+  for (auto& search : searches) res.push_back(search->Result());
+  return res;
 }
 
-void SearchFrom(StatePtr& state_ptr, StateCollector* res) {
+void SearchFrom(StatePtr state_ptr, RouteCache* route_cache,
+                StateCollector* res) {
   thread_local CandidateVector vec;
   vec.clear();
-  const State* state = state_ptr.get();
+  const State* state = state_ptr;
 
   auto [shp, initial_st] = kBricks[state_ptr->situ.step_];
-  state->situ.FindAllMoves(shp, initial_st, &vec);
+  route_cache->FindAllMoves(state->situ, state->situ.MakePlacementMap(shp),
+                            initial_st, &vec);
 
   auto initial_height = state_ptr->occupied_height;
   auto initial_collapse_lines = state_ptr->situ.collapse_lines_;
   auto initial_occupied = state_ptr->situ.TotalOccupied();
 
+  size_t gated = 0;
   for (Candidate& cand : vec) {
     // 高度太低或砖块太少时，禁止消除
     if (auto collapsed = cand.situ.collapse_lines_ - initial_collapse_lines;
@@ -247,58 +960,120 @@ void SearchFrom(StatePtr& state_ptr, StateCollector* res) {
           (kH - 5) * (kW - 1),
       };
       if (initial_height < kThresholdHeight[collapsed - 1] ||
-          initial_occupied < kThresholdOccupied[collapsed - 1])
+          initial_occupied < kThresholdOccupied[collapsed - 1]) {
+        ++gated;
         continue;
+      }
     }
 
-    // 按IsOk剪枝
-    if (!cand.situ.IsOk()) continue;
-
-    if (!state_ptr->situ.ReplayAndVerify(cand.actions, cand.situ)) {
+    // 验证只是为了尽早暴露bug，默认不做
+    bool verify = g_verify_mode == VerifyMode::kAll;
+    if (g_verify_mode == VerifyMode::kSample) {
+      thread_local unsigned sample_counter = 0;
+      verify = ++sample_counter % kVerifySampleInterval == 0;
+    }
+    // 展开时只知道落点可达，验证时才生成操作序列
+    ActionVector actions;
+    if (verify && (!state_ptr->situ.FindRoute(cand.st, &actions) ||
+                   !state_ptr->situ.ReplayAndVerify(actions, cand.situ))) {
       fprintf(stderr, "Verification failed:\n%s\n%s\n%s\n%s\n",
               ShapeDebugString(shp, initial_st.rot).c_str(),
               state_ptr->situ.DebugString().c_str(),
-              Action::Join(cand.actions).c_str(),
-              cand.situ.DebugString().c_str());
+              Action::Join(actions).c_str(), cand.situ.DebugString().c_str());
       exit(1);
     }
 
-    auto quality = cand.situ.Quality();
-    auto occupied_height = cand.situ.OccupiedHeight();
-    res->Add(StatePtr{new State{std::move(cand.situ), quality, occupied_height,
-                                state_ptr, std::move(cand.actions)}});
+    // 去重以后才生成State，并按IsOk剪枝
+    res->Stage(cand.situ, state_ptr->node, cand.st);
   }
+  res->CountExpanded(vec.size(), gated);
 }
 
-// 将from中按key_func计算的最高n个元素移动到to里面
+// 按kBricks依次放下接下来的depth个方块，返回能达到的最高quality
+// quality是situ自己的quality。没有合法落点时返回INT_MIN。
+// 只用于给结点排序，所以不考虑SearchFrom中的禁止消除
+int LookaheadQuality(const Situation& situ, int quality, unsigned depth,
+                     const QualityWeights& weights, RouteCache* route_cache) {
+  if (depth == 0 || situ.step_ >= kSteps) return quality;
+
+  // 每一层递归各用一组缓冲区
+  thread_local CandidateVector vecs[kMaxLookaheadDepth];
+  thread_local std::vector<Situation> situs[kMaxLookaheadDepth];
+  thread_local std::vector<int> qualities[kMaxLookaheadDepth];
+  thread_local std::vector<unsigned> heights[kMaxLookaheadDepth];
+  thread_local absl::InlinedVector<bool, 64> oks[kMaxLookaheadDepth];
+  CandidateVector& vec = vecs[depth - 1];
+
+  auto [shp, initial_st] = kBricks[situ.step_];
+  vec.clear();
+  route_cache->FindAllMoves(situ, situ.MakePlacementMap(shp), initial_st,
+                            &vec);
+  situs[depth - 1].clear();
+  for (const Candidate& cand : vec) situs[depth - 1].push_back(cand.situ);
+  size_t n = situs[depth - 1].size();
+  qualities[depth - 1].resize(n);
+  heights[depth - 1].resize(n);
+  oks[depth - 1].resize(n);
+  EvaluateBatch(situs[depth - 1], weights, qualities[depth - 1].data(),
+                heights[depth - 1].data(), oks[depth - 1].data());
+
+  int best = INT_MIN;
+  for (size_t i = 0; i < n; ++i) {
+    if (!oks[depth - 1][i]) continue;
+    best = std::max(best, LookaheadQuality(situs[depth - 1][i],
+                                           qualities[depth - 1][i], depth - 1,
+                                           weights, route_cache));
+  }
+  return best;
+}
+
+// 将from中按key_func计算的最高n个元素移动到to里面（追加在to原有的元素后面）
 // ancestor_quotas
 // 控制选出的结点的多样性（列表不要过快被来自同一祖先的结点垄断）
 template <typename Callback>
-void MoveTopN(std::vector<StatePtr>& from, std::vector<StatePtr>* to,
-              unsigned n, std::span<unsigned> ancestor_max, uint32_t height_max,
+void MoveTopN(ThreadPool& thread_pool, const SearchTree& tree,
+              std::vector<StatePtr>& from,
+              std::vector<StatePtr>* to, unsigned n,
+              std::span<const unsigned> ancestor_max, uint32_t height_max,
               Callback key_func) {
   if (n == 0) return;
   if (from.size() <= n) {
-    *to = std::move(from);
+    to->insert(to->end(), from.begin(), from.end());
     from.clear();
     return;
   }
 
-  std::sort(from.begin(), from.end(),
-            [&](const StatePtr& a, const StatePtr& b) {
-              auto u = key_func(a), v = key_func(b);
-              if (u != v) return u > v;
-              // 产生一个确定性的排序
-              return a->situ.BricksComp(b->situ) > 0;
-            });
-
   using Value = std::remove_cvref_t<decltype(key_func(from[0]))>;
 
+  // 先把key算好，排序时不再重复计算key、访问State
+  // 只有key相同时才需要比较方块
+  struct Keyed {
+    Value value;
+    StatePtr state_ptr;
+  };
+  std::vector<Keyed> keyed(from.size());
+  ParallelForEachBlock(thread_pool, from.size(),
+                       ParallelBlockCount(thread_pool, from.size()),
+                       [&](size_t, size_t begin, size_t end) {
+                         for (size_t i = begin; i < end; ++i)
+                           keyed[i] = {key_func(from[i]), from[i]};
+                       });
+  ParallelSort(thread_pool, keyed, [](const Keyed& a, const Keyed& b) {
+    if (a.value != b.value) return a.value > b.value;
+    // 产生一个确定性的排序
+    return a.state_ptr->situ.BricksComp(b.state_ptr->situ) > 0;
+  });
+  for (size_t i = 0; i < from.size(); ++i) from[i] = keyed[i].state_ptr;
+
   struct ParentQuotaInfo {
     unsigned cnt{0};
     Value value{};
   };
-  absl::flat_hash_map<State*, ParentQuotaInfo> quota_map;
+  // 祖先在搜索树中的层数和下标合成一个key
+  absl::flat_hash_map<uint64_t, ParentQuotaInfo> quota_map;
+  auto ancestor_key = [](uint32_t step, uint32_t node) {
+    return uint64_t(step) << 32 | node;
+  };
 
   ParentQuotaInfo height_quota_map[kH];
 
@@ -308,25 +1083,25 @@ void MoveTopN(std::vector<StatePtr>& from, std::vector<StatePtr>* to,
     return (info.cnt < max || value == info.value);
   };
 
-  auto parent_quota_check = [&](const StatePtr& parent_ptr, const Value& value,
+  auto parent_quota_check = [&](uint64_t key, const Value& value,
                                 unsigned max) -> bool {
-    if (!parent_ptr) return true;
-    auto& info = quota_map[parent_ptr.get()];
+    auto& info = quota_map[key];
     return quota_check(info, value, max);
   };
 
   std::vector<StatePtr> res_buffer;
   for (auto& state_ptr : from) {
-    State* node = state_ptr.get();
+    uint32_t step = state_ptr->situ.step_;
+    uint32_t node = state_ptr->parent;
     auto value = key_func(state_ptr);
     bool skip = false;
     for (unsigned max : ancestor_max) {
-      if (!node->parent) break;
-      if (!parent_quota_check(node->parent, value, max)) {
+      if (node == SearchTree::kNone) break;
+      if (!parent_quota_check(ancestor_key(--step, node), value, max)) {
         skip = true;
         break;
       }
-      node = node->parent.get();
+      node = tree.Parent(step, node);
     }
     if (skip) continue;
 
@@ -340,80 +1115,261 @@ void MoveTopN(std::vector<StatePtr>& from, std::vector<StatePtr>* to,
     if (n) --n;
 
     // 现在才给各处info的cnt真正加上
-    for (State* node = state_ptr.get(); unsigned max : ancestor_max) {
+    step = state_ptr->situ.step_;
+    node = state_ptr->parent;
+    for (unsigned max : ancestor_max) {
       static_cast<void>(max);  // Supress warning
-      if (!node->parent) break;
-      quota_map[node->parent.get()].cnt++;
-      node = node->parent.get();
+      if (node == SearchTree::kNone) break;
+      quota_map[ancestor_key(--step, node)].cnt++;
+      node = tree.Parent(step, node);
     }
     height_info.cnt++;
 
-    res_buffer.push_back(std::move(state_ptr));
-    state_ptr.reset();  // Make sure it becomes nullptr
+    res_buffer.push_back(state_ptr);
+    state_ptr = nullptr;
   }
-  std::erase_if(from, [](StatePtr& state_ptr) { return !state_ptr; });
+  ParallelEraseIf(thread_pool, from,
+                  [](const StatePtr& state_ptr) { return !state_ptr; });
 
   for (auto& state_ptr : res_buffer) to->push_back(std::move(state_ptr));
 }
 
 // 保留State的策略
-void ChooseForNextStep(std::vector<StatePtr>&& orig,
-                       std::vector<StatePtr>* res) {
+void ChooseForNextStep(const SearchParams& params, ThreadPool& thread_pool,
+                       RouteCache* route_cache, const SearchTree& tree,
+                       std::vector<StatePtr>&& orig, const ChildLimits& limits,
+                       std::vector<StatePtr>* res, StepStats* stats) {
   res->clear();
   if (orig.empty()) return;
 
   // 剪掉score比最大值小太多的，高度比最高值小太多的
-  uint32_t max_score = 0;
-  uint32_t max_height = 0;
-  for (StatePtr& state_ptr : orig) {
-    auto& situ = state_ptr->situ;
-    max_score = std::max(max_score, situ.score_);
-    max_height = std::max(max_height, state_ptr->occupied_height);
-  }
-  std::erase_if(orig, [max_score, max_height](const StatePtr& state_ptr) {
-    return state_ptr->situ.score_ + FLAGS_ignore_score_threshold < max_score ||
-           state_ptr->occupied_height + FLAGS_ignore_height_threshold <
+  // 最大值是对所有子结点统计的，orig中可能只有其中一部分
+  uint32_t max_score = limits.max_score;
+  uint32_t max_height = limits.max_height;
+  size_t orig_size = orig.size();
+  ParallelEraseIf(thread_pool, orig, [&](const StatePtr& state_ptr) {
+    return state_ptr->situ.score_ + params.ignore_score_threshold < max_score ||
+           state_ptr->occupied_height + params.ignore_height_threshold <
                max_height;
   });
+  stats->ignored = orig_size - orig.size();
 
   // quality最高的，分数最高的各保留一些
 
-  if (orig.size() <= g_quality_keep_count + g_score_keep_count) {
+  if (orig.size() <= params.quality_keep_count + params.score_keep_count) {
     res->swap(orig);
+    stats->beam_after_score = stats->beam_after_quality = res->size();
     return;
   }
 
   // 先取每次消除平均得分最高的
-  MoveTopN(orig, res, g_score_keep_count, g_score_parent_quota,
-           g_score_keep_count * FLAGS_score_height_quota,
+  MoveTopN(thread_pool, tree, orig, res, params.score_keep_count,
+           params.score_parent_quota,
+           params.score_keep_count * params.score_height_quota,
            [](const StatePtr& state_ptr) {
-             auto& situ = state_ptr->situ;
-             return std::make_tuple(
-                 uint64_t(situ.score_) * 10000 /
-                     std::max<uint32_t>(situ.collapse_count_, 1),
-                 situ.score_, state_ptr->quality);
+             return ScoreKey(state_ptr->situ, state_ptr->quality);
            });
+  stats->beam_after_score = res->size();
 
-  // 再取quality最好的
-  MoveTopN(orig, res, g_quality_keep_count, g_quality_parent_quota,
-           g_quality_keep_count * FLAGS_quality_height_quota,
-           [](const StatePtr& state_ptr) {
-             return std::make_pair(state_ptr->quality, state_ptr->situ.score_);
-           });
+  auto quality_key = [](const StatePtr& state_ptr) {
+    return QualityKey(state_ptr->situ, state_ptr->quality);
+  };
+  if (params.lookahead_factor <= 0) {
+    // 再取quality最好的
+    MoveTopN(thread_pool, tree, orig, res, params.quality_keep_count,
+             params.quality_parent_quota,
+             params.quality_keep_count * params.quality_height_quota,
+             quality_key);
+    stats->beam_after_quality = res->size();
+    return;
+  }
+
+  // 向后看：先按quality取出若干倍的候选（不设配额），
+  // 再按放下接下来的方块后能达到的最高quality选。
+  // 其余的结点排在所有候选之后，配额用完时仍可以补上
+  std::vector<StatePtr> candidates;
+  MoveTopN(thread_pool, tree, orig, &candidates,
+           params.quality_keep_count * params.lookahead_factor, {}, UINT32_MAX,
+           quality_key);
+  thread_pool.SyncRunSpan(std::span(candidates), [&](StatePtr state_ptr) {
+    state_ptr->lookahead =
+        LookaheadQuality(state_ptr->situ, state_ptr->quality,
+                         params.lookahead_depth, params.quality_weights,
+                         route_cache);
+  });
+  for (StatePtr state_ptr : orig) state_ptr->lookahead = INT_MIN;
+  candidates.insert(candidates.end(), orig.begin(), orig.end());
+  MoveTopN(thread_pool, tree, candidates, res, params.quality_keep_count,
+           params.quality_parent_quota,
+           params.quality_keep_count * params.quality_height_quota,
+           [](const StatePtr& state_ptr) { return LookaheadKey(*state_ptr); });
+  stats->beam_after_quality = res->size();
+}
+
+bool BetterGlobalBest(const State& a, const State& b) {
+  auto u = GlobalBestKey(a.situ, a.quality);
+  auto v = GlobalBestKey(b.situ, b.quality);
+  return u > v || (u == v && a.situ.BricksComp(b.situ) > 0);
+}
+
+// 快照中保存的结点，操作序列在搜索树中
+struct SavedState {
+  Situation situ;
+  int quality;
+  unsigned occupied_height;
+  uint32_t node;
+};
+
+constexpr uint64_t kSnapshotMagic = 0x50414e5352544554;  // "TETRSNAP"
+constexpr uint32_t kSnapshotVersion = 2;
+
+struct SnapshotHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t steps;      // kSteps
+  uint32_t next_step;  // 恢复后从这一步继续
+};
+
+SavedState ToSaved(const State& state) {
+  return {state.situ, state.quality, state.occupied_height, state.node};
 }
 
-Solution MakeSolution(State* state,
+bool SaveSnapshot(const std::string& path, const SearchTree& tree,
+                  std::span<const StatePtr> step_bests,
+                  const State& global_best,
+                  const std::vector<unsigned>& score_by_step) {
+  uint32_t next_step = score_by_step.size();
+  std::vector<SavedState> beam;
+  for (StatePtr state_ptr : step_bests) beam.push_back(ToSaved(*state_ptr));
+
+  SnapshotWriter writer;
+  writer.AddValue(
+      SnapshotHeader{kSnapshotMagic, kSnapshotVersion, kSteps, next_step});
+  writer.Add(std::span<const SavedState>(beam));
+  writer.AddValue(ToSaved(global_best));
+  writer.Add(std::span<const unsigned>(score_by_step));
+  tree.Save(next_step, &writer);
+  return writer.Commit(path);
+}
+
+bool LoadSnapshot(const std::string& path, SearchTree* tree,
+                  StateArenas* arenas, std::vector<StatePtr>* step_bests,
+                  State* global_best, std::vector<unsigned>* score_by_step) {
+  SnapshotReader reader;
+  if (!reader.Open(path)) return false;
+
+  SnapshotHeader header;
+  if (!reader.ReadValue(&header) || header.magic != kSnapshotMagic ||
+      header.version != kSnapshotVersion || header.steps != kSteps ||
+      header.next_step >= kSteps) {
+    fprintf(stderr, "Invalid snapshot header\n");
+    return false;
+  }
+
+  std::span<const SavedState> beam;
+  SavedState best;
+  std::span<const unsigned> scores;
+  if (!reader.Read(&beam) || !reader.ReadValue(&best) ||
+      !reader.Read(&scores) || scores.size() != header.next_step ||
+      !tree->Load(&reader))
+    return false;
+  // 结点下标必须在搜索树中
+  if (best.situ.step_ > header.next_step ||
+      !tree->Contains(best.situ.step_, best.node))
+    return false;
+
+  // 落点都在搜索树中，State不需要
+  Arena* arena = arenas->ArenaFor(header.next_step);
+  step_bests->clear();
+  for (const SavedState& saved : beam) {
+    if (saved.situ.step_ != header.next_step ||
+        !tree->Contains(header.next_step, saved.node))
+      return false;
+    step_bests->push_back(arena->New<State>(
+        saved.situ, saved.quality, saved.occupied_height, SearchTree::kNone,
+        saved.node, BrickStatus{}));
+  }
+  *global_best = State{best.situ, best.quality, best.occupied_height,
+                       SearchTree::kNone, best.node, BrickStatus{}};
+  score_by_step->assign(scores.begin(), scores.end());
+  return true;
+}
+
+Solution MakeSolution(const SearchTree& tree, const State& state,
                       const std::vector<unsigned>& score_by_step) {
   Solution res;
-  res.final_situ = state->situ;
-  res.score_by_step = score_by_step;
-
-  while (state && state->situ.step_ >= 1) {
-    res.actions.insert(res.actions.end(), state->actions.rbegin(),
-                       state->actions.rend());
+  // 搜索树中只有落点，从头依次放下每个方块，重新寻路得到操作序列
+  Situation situ;
+  ActionVector route;
+  for (BrickStatus landing : tree.Backtrack(state.situ.step_, state.node)) {
+    route.clear();
+    if (!situ.FindRoute(landing, &route)) {
+      fprintf(stderr, "No route to landing at step %u\n", situ.step_);
+      exit(1);
+    }
     res.actions.push_back({kNew});
-    state = state->parent.get();
+    res.actions.insert(res.actions.end(), route.begin(), route.end());
+    situ = situ.PutCopy(kBricks[situ.step_].first, landing);
+    situ.CollapseInPlace();
   }
-  std::reverse(res.actions.begin(), res.actions.end());
+  res.final_situ = state.situ;
+  res.score_by_step = score_by_step;
   return res;
 }
+
+void BenchmarkSearch(std::span<const Situation> corpus, Benchmark* bench) {
+  ThreadPool thread_pool(FLAGS_threads, FLAGS_pin_threads);
+  SearchParams params = SearchParams::FromFlags();
+
+  // 样本中每个局面的所有子结点，作为StateCollector的输入
+  struct Child {
+    Situation situ;
+    uint32_t parent;
+    BrickStatus landing;
+  };
+  std::vector<Child> children;
+  CandidateVector vec;
+  for (uint32_t i = 0; i < corpus.size(); ++i) {
+    auto [shp, initial_st] = kBricks[corpus[i].step_];
+    vec.clear();
+    corpus[i].FindAllMoves(shp, initial_st, &vec);
+    for (Candidate& cand : vec) children.push_back({cand.situ, i, cand.st});
+  }
+
+  // 子结点都放在arenas的第1代里
+  StateArenas arenas(thread_pool.size());
+  StateCollector collector(thread_pool.size(), params);
+  std::vector<StatePtr> collected;
+  auto collect = [&](StepStats* stats) {
+    for (const Child& child : children)
+      collector.Stage(child.situ, child.parent, child.landing);
+    collected.clear();
+    return collector.MoveTo(&thread_pool, &arenas, 0, &collected, stats);
+  };
+  bench->Run("StateCollector::Stage+MoveTo", children.size(), [&] {
+    StepStats stats;
+    DoNotOptimize(collect(&stats));
+    arenas.Release(1);
+  });
+
+  // 样本中的局面作为父结点，都放在搜索树的第0层，子结点算作第1步的
+  StepStats stats;
+  collect(&stats);
+  SearchTree tree;
+  for (size_t i = 0; i < corpus.size(); ++i)
+    tree.Add(0, SearchTree::kNone, {});
+  for (StatePtr state_ptr : collected) state_ptr->situ.step_ = 1;
+
+  // 与ChooseForNextStep中按分数选择相同，每次从全部子结点中选出一半
+  unsigned n = collected.size() / 2;
+  std::vector<StatePtr> from, to;
+  bench->Run("MoveTopN", collected.size(), [&] {
+    from = collected;
+    to.clear();
+    MoveTopN(thread_pool, tree, from, &to, n, params.score_parent_quota,
+             n * params.score_height_quota, [](const StatePtr& state_ptr) {
+               return ScoreKey(state_ptr->situ, state_ptr->quality);
+             });
+    DoNotOptimize(to.data());
+  });
+}
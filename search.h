@@ -1,9 +1,13 @@
 #pragma once
 
+#include <span>
+#include <string>
 #include <vector>
 
 #include "tetris_common.h"
 
+class Benchmark;
+
 struct Solution {
   std::vector<Action> actions;
   Situation final_situ;
@@ -11,3 +15,11 @@ struct Solution {
 };
 
 Solution Solve();
+
+// 同时搜索多组参数，结果按configs的顺序返回
+// configs的每一项是空格分隔的flags（如"--total_keep=1000 --score_keep_ratio=0.2"），
+// 在命令行flags的基础上覆盖；各配置共用一个线程池，逐步同时推进
+std::vector<Solution> SolveConfigs(const std::vector<std::string>& configs);
+
+// 基准测试：用样本局面测试StateCollector和MoveTopN（见bench.cc）
+void BenchmarkSearch(std::span<const Situation> corpus, Benchmark* bench);
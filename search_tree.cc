@@ -0,0 +1,79 @@
+#include "search_tree.h"
+
+#include <algorithm>
+
+uint32_t SearchTree::Add(uint32_t step, uint32_t parent, BrickStatus landing) {
+  Level& level = levels_[step];
+  level.nodes.push_back({parent, landing});
+  return level.nodes.size() - 1;
+}
+
+void SearchTree::Prune() {
+  if (kept_.empty()) return;
+
+  // 从最深的一层开始，逐层向上标记，new_index暂时用作标记
+  uint32_t max_step = 0;
+  for (auto [step, node] : kept_) max_step = std::max(max_step, step);
+  for (uint32_t step = 0; step <= max_step; ++step)
+    levels_[step].new_index.assign(levels_[step].nodes.size(), kNone);
+  for (auto [step, node] : kept_) levels_[step].new_index[node] = 0;
+  kept_.clear();
+
+  for (uint32_t step = max_step; step > 0; --step) {
+    Level& level = levels_[step];
+    Level& parent_level = levels_[step - 1];
+    for (uint32_t i = 0; i < level.nodes.size(); ++i)
+      if (level.new_index[i] != kNone)
+        parent_level.new_index[level.nodes[i].parent] = 0;
+  }
+
+  // 从根开始逐层压缩，父结点的新下标已经算好
+  for (uint32_t step = 0; step <= max_step; ++step) {
+    Level& level = levels_[step];
+    std::vector<Node> nodes;
+    for (uint32_t i = 0; i < level.nodes.size(); ++i) {
+      if (level.new_index[i] == kNone) continue;
+      level.new_index[i] = nodes.size();
+      uint32_t parent = level.nodes[i].parent;
+      if (parent != kNone) parent = levels_[step - 1].new_index[parent];
+      nodes.push_back({parent, level.nodes[i].landing});
+    }
+    level.nodes = std::move(nodes);
+  }
+}
+
+std::vector<BrickStatus> SearchTree::Backtrack(uint32_t step,
+                                               uint32_t node) const {
+  std::vector<BrickStatus> res;
+  for (; step >= 1; --step) {
+    res.push_back(Landing(step, node));
+    node = Parent(step, node);
+  }
+  std::reverse(res.begin(), res.end());
+  return res;
+}
+
+void SearchTree::Save(uint32_t max_step, SnapshotWriter* writer) const {
+  writer->AddValue(max_step);
+  for (uint32_t step = 0; step <= max_step; ++step) {
+    writer->Add(std::span<const Node>(levels_[step].nodes));
+  }
+}
+
+bool SearchTree::Load(SnapshotReader* reader) {
+  uint32_t max_step;
+  if (!reader->ReadValue(&max_step) || max_step > kSteps) return false;
+  levels_.assign(kSteps + 1, Level());
+  kept_.clear();
+  for (uint32_t step = 0; step <= max_step; ++step) {
+    std::span<const Node> nodes;
+    if (!reader->Read(&nodes)) return false;
+    // 第0层只有根，其余各层的父结点必须在上一层中
+    for (const Node& node : nodes) {
+      if (step == 0 ? node.parent != kNone : !Contains(step - 1, node.parent))
+        return false;
+    }
+    levels_[step].nodes.assign(nodes.begin(), nodes.end());
+  }
+  return true;
+}
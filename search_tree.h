@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <span>
+#include <vector>
+
+#include "snapshot.h"
+#include "tetris_common.h"
+
+// 紧凑的搜索树，只保存回溯最终操作序列所需的信息
+// 每一步（层）的结点放在一个数组里，用32位下标指向上一层的父结点，
+// 每个结点只记录方块的落点，操作序列在回溯时再重新寻路得到
+class SearchTree {
+ public:
+  static constexpr uint32_t kNone = uint32_t(-1);
+
+  SearchTree() : levels_(kSteps + 1) {}
+
+  // 在第step层加入一个结点，返回它的下标
+  uint32_t Add(uint32_t step, uint32_t parent, BrickStatus landing);
+
+  uint32_t Parent(uint32_t step, uint32_t node) const {
+    return levels_[step].nodes[node].parent;
+  }
+
+  BrickStatus Landing(uint32_t step, uint32_t node) const {
+    return levels_[step].nodes[node].landing;
+  }
+
+  // 第step层是否有下标为node的结点
+  bool Contains(uint32_t step, uint32_t node) const {
+    return step < levels_.size() && node < levels_[step].nodes.size();
+  }
+
+  // 标记需要保留的结点，它的祖先也都会被保留
+  void Keep(uint32_t step, uint32_t node) { kept_.push_back({step, node}); }
+
+  // 删除所有没有被Keep的结点（及其祖先以外的结点），剩下的重新编号
+  // 之后用NewIndex取得被Keep的结点的新下标
+  void Prune();
+  uint32_t NewIndex(uint32_t step, uint32_t node) const {
+    return levels_[step].new_index[node];
+  }
+
+  // 从指定结点回溯到根，得到第1步到第step步的落点
+  std::vector<BrickStatus> Backtrack(uint32_t step, uint32_t node) const;
+
+  // 把第0到max_step层写入快照，写入的数据在writer.Commit前必须保持不变
+  void Save(uint32_t max_step, SnapshotWriter* writer) const;
+  // 从快照中读出，替换当前内容，失败（包括父结点下标越界）返回false
+  bool Load(SnapshotReader* reader);
+
+ private:
+  struct Node {
+    uint32_t parent;      // 在上一层的下标
+    BrickStatus landing;  // 这一步方块的落点
+  };
+
+  struct Level {
+    std::vector<Node> nodes;
+    std::vector<uint32_t> new_index;  // Prune时使用
+  };
+
+  std::vector<Level> levels_;
+  std::vector<std::pair<uint32_t, uint32_t>> kept_;
+};
@@ -0,0 +1,103 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace {
+
+size_t AlignUp(size_t n) {
+  return (n + kSnapshotAlign - 1) & ~(kSnapshotAlign - 1);
+}
+
+}  // namespace
+
+void SnapshotWriter::AddRaw(const void* data, size_t size) {
+  sections_.push_back({data, size, 0});
+  size_ += AlignUp(size);
+}
+
+void SnapshotWriter::AddCopy(const void* data, size_t size) {
+  size_t pos = inline_data_.size();
+  inline_data_.insert(inline_data_.end(), static_cast<const char*>(data),
+                      static_cast<const char*>(data) + size);
+  sections_.push_back({nullptr, size, pos});
+  size_ += AlignUp(size);
+}
+
+bool SnapshotWriter::Commit(const std::string& path) {
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(tmp_path.c_str());
+    return false;
+  }
+  if (size_ == 0 || ftruncate(fd, size_) != 0) {
+    perror("ftruncate");
+    close(fd);
+    return false;
+  }
+  char* p = static_cast<char*>(
+      mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  size_t offset = 0;
+  for (const Section& section : sections_) {
+    const void* data = section.data ? section.data
+                                    : inline_data_.data() + section.inline_pos;
+    if (section.size) memcpy(p + offset, data, section.size);
+    offset += AlignUp(section.size);
+  }
+
+  bool ok = msync(p, size_, MS_SYNC) == 0;
+  if (!ok) perror("msync");
+  munmap(p, size_);
+  if (ok && rename(tmp_path.c_str(), path.c_str()) != 0) {
+    perror("rename");
+    ok = false;
+  }
+  return ok;
+}
+
+SnapshotReader::~SnapshotReader() {
+  if (data_) munmap(const_cast<char*>(data_), size_);
+}
+
+bool SnapshotReader::Open(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(path.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  data_ = static_cast<const char*>(p);
+  size_ = st.st_size;
+  pos_ = 0;
+  return true;
+}
+
+bool SnapshotReader::ReadRaw(size_t size, const void** res) {
+  if (size > size_ - pos_) return false;
+  *res = data_ + pos_;
+  pos_ = std::min(size_, pos_ + AlignUp(size));
+  return true;
+}
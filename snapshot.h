@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <span>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// 快照文件的读写
+// 文件由若干段连续的二进制数据组成，写入和读取的顺序必须一致。
+// 只能用于可以平凡复制的类型，不考虑跨平台兼容。
+// 每段数据都按kSnapshotAlign对齐，读取时可以直接使用映射的内存。
+
+constexpr size_t kSnapshotAlign = 8;
+
+class SnapshotWriter {
+ public:
+  // 要写入的数据只记录指针，直到Commit才真正复制，期间数据必须保持有效
+  template <typename T>
+  void Add(std::span<const T> data) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    AddValue(uint64_t(data.size()));
+    static_assert(alignof(T) <= kSnapshotAlign);
+    AddRaw(data.data(), data.size_bytes());
+  }
+
+  // 值会被立即复制
+  template <typename T>
+  void AddValue(const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    AddCopy(&value, sizeof(T));
+  }
+
+  // 先写入临时文件（通过mmap），再原子地替换path，失败返回false
+  bool Commit(const std::string& path);
+
+ private:
+  void AddRaw(const void* data, size_t size);
+  void AddCopy(const void* data, size_t size);
+
+  struct Section {
+    const void* data;  // 为nullptr时数据在inline_data_中
+    size_t size;
+    size_t inline_pos;
+  };
+  std::vector<Section> sections_;
+  // 小的值直接复制到这里，避免调用者保证其生命周期
+  std::vector<char> inline_data_;
+  size_t size_ = 0;
+};
+
+class SnapshotReader {
+ public:
+  SnapshotReader() = default;
+  SnapshotReader(const SnapshotReader&) = delete;
+  SnapshotReader& operator=(const SnapshotReader&) = delete;
+  ~SnapshotReader();
+
+  // 用mmap打开文件，失败返回false
+  bool Open(const std::string& path);
+
+  // 读出Add写入的数组，返回的span指向映射的内存，在reader析构前有效
+  // 数据不足时返回false
+  template <typename T>
+  bool Read(std::span<const T>* res) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    static_assert(alignof(T) <= kSnapshotAlign);
+    uint64_t n;
+    if (!ReadValue(&n) || n > size_ / sizeof(T)) return false;
+    const void* p;
+    if (!ReadRaw(n * sizeof(T), &p)) return false;
+    *res = {static_cast<const T*>(p), size_t(n)};
+    return true;
+  }
+
+  template <typename T>
+  bool ReadValue(T* res) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    static_assert(alignof(T) <= kSnapshotAlign);
+    const void* p;
+    if (!ReadRaw(sizeof(T), &p)) return false;
+    *res = *static_cast<const T*>(p);
+    return true;
+  }
+
+ private:
+  bool ReadRaw(size_t size, const void** res);
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t pos_ = 0;
+};
@@ -0,0 +1,68 @@
+#include "telemetry.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+
+#include <utility>
+
+TelemetryWriter::~TelemetryWriter() {
+  if (fp_) fclose(fp_);
+}
+
+bool TelemetryWriter::Open(const std::string& path) {
+  fp_ = fopen(path.c_str(), "w");
+  if (!fp_) {
+    perror(path.c_str());
+    return false;
+  }
+  json_ = absl::EndsWith(path, ".json");
+  return true;
+}
+
+void TelemetryWriter::Write(const StepStats& s) {
+  double dedup_hit_ratio =
+      s.staged ? 1. - double(s.unique) / double(s.staged) : 0.;
+  std::pair<const char*, std::string> fields[] = {
+      {"step", absl::StrCat(s.step)},
+      {"expand_us", absl::StrCat(s.expand_us)},
+      {"collect_us", absl::StrCat(s.collect_us)},
+      {"global_best_us", absl::StrCat(s.global_best_us)},
+      {"choose_us", absl::StrCat(s.choose_us)},
+      {"tree_us", absl::StrCat(s.tree_us)},
+      {"generated", absl::StrCat(s.generated)},
+      {"gated", absl::StrCat(s.gated)},
+      {"staged", absl::StrCat(s.staged)},
+      {"unique", absl::StrCat(s.unique)},
+      {"dedup_hit_ratio", absl::StrCat(dedup_hit_ratio)},
+      {"not_ok", absl::StrCat(s.not_ok)},
+      {"collected", absl::StrCat(s.collected)},
+      {"ignored", absl::StrCat(s.ignored)},
+      {"total_keep", absl::StrCat(s.total_keep)},
+      {"beam_after_score", absl::StrCat(s.beam_after_score)},
+      {"beam_after_quality", absl::StrCat(s.beam_after_quality)},
+      {"best_score", absl::StrCat(s.best_score)},
+  };
+
+  std::string line;
+  if (json_) {
+    for (auto& [name, value] : fields)
+      absl::StrAppend(&line, line.empty() ? "{" : ",", "\"", name,
+                      "\":", value);
+    line += "}\n";
+  } else {
+    // 第一行是表头
+    if (!header_written_) {
+      header_written_ = true;
+      for (auto& [name, value] : fields)
+        absl::StrAppend(&line, line.empty() ? "" : ",", name);
+      line += "\n";
+    }
+    bool first = true;
+    for (auto& [name, value] : fields) {
+      absl::StrAppend(&line, first ? "" : ",", value);
+      first = false;
+    }
+    line += "\n";
+  }
+  fputs(line.c_str(), fp_);
+}
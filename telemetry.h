@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+
+// 每一步的统计，用于分析时间花在了哪里、剪枝的效果如何
+struct StepStats {
+  uint32_t step = 0;
+
+  // 各阶段的耗时（微秒）
+  // 多配置时所有配置一起展开，expand_us是它们共同的耗时
+  uint64_t expand_us = 0;       // SearchFrom
+  uint64_t collect_us = 0;      // StateCollector::MoveTo（去重、评估）
+  uint64_t global_best_us = 0;  // 找全局最优
+  uint64_t choose_us = 0;       // ChooseForNextStep
+  uint64_t tree_us = 0;         // 记入搜索树、清理、保存快照
+
+  // 子结点数量
+  uint64_t generated = 0;  // FindAllMoves找到的
+  uint64_t gated = 0;      // 因高度或砖块太少禁止消除而跳过的
+  uint64_t staged = 0;     // 暂存到StateCollector的
+  uint64_t unique = 0;     // 去重以后的
+  uint64_t not_ok = 0;     // 去重以后被IsOk剪掉的
+  uint64_t collected = 0;  // 生成了State的（开启流式选择时会更少）
+  uint64_t ignored = 0;    // ChooseForNextStep中按分数和高度剪掉的
+
+  uint64_t total_keep = 0;  // 要选出的结点数，开启--time_budget时逐步调整
+
+  // 两次MoveTopN以后选出的结点数
+  uint64_t beam_after_score = 0;
+  uint64_t beam_after_quality = 0;
+
+  uint32_t best_score = 0;
+};
+
+// 把每一步的统计写入文件
+// 文件名以.json结尾时每行一个JSON对象（JSON Lines），否则写成CSV
+class TelemetryWriter {
+ public:
+  TelemetryWriter() = default;
+  TelemetryWriter(const TelemetryWriter&) = delete;
+  TelemetryWriter& operator=(const TelemetryWriter&) = delete;
+  ~TelemetryWriter();
+
+  // 失败返回false
+  bool Open(const std::string& path);
+  bool is_open() const { return fp_ != nullptr; }
+
+  void Write(const StepStats& stats);
+
+ private:
+  FILE* fp_ = nullptr;
+  bool json_ = false;
+  bool header_written_ = false;
+};
+
+// 计时器，Lap返回上次调用（或构造）以来经过的微秒数
+class Stopwatch {
+ public:
+  uint64_t Lap() {
+    auto now = std::chrono::steady_clock::now();
+    auto res =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - last_);
+    last_ = now;
+    return res.count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point last_ =
+      std::chrono::steady_clock::now();
+};
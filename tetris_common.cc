@@ -1,12 +1,206 @@
 #include "tetris_common.h"
 
 #include <math.h>
+#include <string.h>
 
 #include <limits>
+#include <utility>
 
 #include <absl/strings/str_cat.h>
 #include <gflags/gflags.h>
 
+namespace {
+
+// 按形状（和方向）特化的内核
+// 格子的偏移、边界和方向数都是编译期常量，编译器可以完全展开循环，
+// 把形状的几何信息直接折叠进指令里。对外的函数按形状查表分发。
+
+template <Shape kShp>
+constexpr unsigned kRotCnt = kShapeDesc[kShp].cnt;
+
+// 对kShp的每个方向调用func(std::integral_constant<unsigned, rot>)
+template <Shape kShp, typename Callback>
+inline void ForEachRot(Callback&& func) {
+  [&]<unsigned... kRots>(std::integer_sequence<unsigned, kRots...>) {
+    (func(std::integral_constant<unsigned, kRots>()), ...);
+  }(std::make_integer_sequence<unsigned, kRotCnt<kShp>>());
+}
+
+// 对kShp第kRot个方向的每个格子调用func(dx, dy)，dx和dy是std::integral_constant
+template <Shape kShp, unsigned kRot, typename Callback>
+inline void ForEachCell(Callback&& func) {
+  [&]<size_t... kI>(std::index_sequence<kI...>) {
+    (func(std::integral_constant<int, kShapeDesc[kShp].pos[kRot][kI].x>(),
+          std::integral_constant<int, kShapeDesc[kShp].pos[kRot][kI].y>()),
+     ...);
+  }(std::make_index_sequence<4>());
+}
+
+// 分发表：MakeShapeTable<Impl>()[shp]为Impl<shp>::Run
+template <template <Shape> class Impl>
+constexpr auto MakeShapeTable() {
+  return []<size_t... kI>(std::index_sequence<kI...>) {
+    return std::array{&Impl<Shape(kI)>::Run...};
+  }(std::make_index_sequence<kShapes>());
+}
+
+// 分发表：MakeShapeRotTable<Impl>()[shp][rot]为Impl<shp, rot>::Run
+// 不存在的方向格子偏移都是0，与直接查kShapeDesc的行为相同
+template <template <Shape, unsigned> class Impl>
+constexpr auto MakeShapeRotTable() {
+  return []<size_t... kI>(std::index_sequence<kI...>) {
+    return std::array{std::array{
+        &Impl<Shape(kI), 0>::Run, &Impl<Shape(kI), 1>::Run,
+        &Impl<Shape(kI), 2>::Run, &Impl<Shape(kI), 3>::Run}...};
+  }(std::make_index_sequence<kShapes>());
+}
+
+template <Shape kShp, unsigned kRot>
+struct FitsKernel {
+  static bool Run(const Situation& situ, int x, int y) {
+    constexpr ShapeBound kBound = kShapeBounds[kShp][kRot];
+    if (x + kBound.min_x < 0 || x + kBound.max_x >= int(kW)) return false;
+    // y 只用检查max即可，min可以小于0
+    if (y + kBound.max_y < 0 || y + kBound.max_y >= int(kH)) return false;
+
+    bool fits = true;
+    ForEachCell<kShp, kRot>([&](auto dx, auto dy) {
+      fits = fits && !(y + dy >= 0 && situ(x + dx, y + dy));
+    });
+    return fits;
+  }
+};
+
+template <Shape kShp, unsigned kRot>
+struct PutCopyKernel {
+  static Situation Run(const Situation& situ, int x, int y) {
+    Situation res = situ;
+    ForEachCell<kShp, kRot>([&](auto dx, auto dy) {
+      if (XInRange(x + dx) && YInRange(y + dy)) res(y + dy) |= 1u << (x + dx);
+    });
+    return res;
+  }
+};
+
+// free_rows[y + 2] 是第y行的空格，y < 0 视为全空，y >= kH 视为全满
+// 返回第y行中kShp第kRot个方向可以放下的位置
+template <Shape kShp, unsigned kRot>
+inline uint32_t FitsRow(const uint32_t* free_rows, unsigned y) {
+  constexpr uint16_t kRowBitMask = Situation::kRowBitMask;
+  // 第x位表示(x + dx, y + dy)是空的，移出左右边界的位自然变为0
+  uint32_t mask = kRowBitMask;
+  ForEachCell<kShp, kRot>([&](auto dx, auto dy) {
+    constexpr int kDx = decltype(dx)::value;
+    uint32_t f = free_rows[y + dy + 2];
+    if constexpr (kDx >= 0)
+      mask &= f >> kDx;
+    else
+      mask &= f << -kDx;
+  });
+  return mask & kRowBitMask;
+}
+
+template <Shape kShp>
+struct MakePlacementMapKernel {
+  static PlacementMap Run(const Situation& situ) {
+    constexpr uint16_t kRowBitMask = Situation::kRowBitMask;
+    uint32_t free_rows[kH + 4];
+    free_rows[0] = free_rows[1] = kRowBitMask;
+    for (unsigned y = 0; y < kH; ++y) free_rows[y + 2] = ~situ(y) & kRowBitMask;
+    free_rows[kH + 2] = free_rows[kH + 3] = 0;
+
+    PlacementMap res{kShp, {}};
+    ForEachRot<kShp>([&](auto rot) {
+      for (unsigned y = 0; y < kH; ++y)
+        res.fits[rot][y] = FitsRow<kShp, rot>(free_rows, y);
+    });
+    return res;
+  }
+};
+
+// 见RouteMap::Build，方向数是编译期常量
+template <unsigned kRotCnt>
+void BuildRoutes(RouteMap* routes, const PlacementMap& map,
+                 BrickStatus initial_st) {
+  auto& reached = routes->reached;
+  auto& via = routes->via;
+  routes->from = initial_st;
+  routes->rot_cnt = kRotCnt;
+  routes->max_y = initial_st.y;
+  memset(reached, 0, sizeof(reached));
+  memset(via, 0, sizeof(via));
+
+  // 当前一层的结点，只记录y的范围，避免扫描整个状态空间
+  uint16_t frontier[4][kH + 1]{};
+  uint16_t next[4][kH + 1]{};
+  unsigned min_y = initial_st.y, max_y = initial_st.y;
+  reached[initial_st.rot][initial_st.y] = 1 << initial_st.x;
+  frontier[initial_st.rot][initial_st.y] = 1 << initial_st.x;
+
+  for (unsigned dist = 0; dist < kMaxMovesPerBrick && min_y <= max_y;
+       ++dist) {
+    unsigned next_min_y = kH, next_max_y = 0;
+    auto visit = [&](unsigned rot, unsigned y, ActionType type,
+                     uint32_t bitmask) {
+      bitmask &= map.fits[rot][y] & ~reached[rot][y];
+      if (bitmask == 0) return;
+      reached[rot][y] |= bitmask;
+      via[rot][y][type] |= bitmask;
+      next[rot][y] |= bitmask;
+      next_min_y = std::min(next_min_y, y);
+      next_max_y = std::max(next_max_y, y);
+    };
+
+#pragma unroll
+    for (unsigned rot = 0; rot < kRotCnt; ++rot) {
+      unsigned next_rot = (rot + 1) & (kRotCnt - 1);
+      for (unsigned y = min_y; y <= max_y; ++y) {
+        uint32_t f = frontier[rot][y];
+        if (f == 0) continue;
+        frontier[rot][y] = 0;
+        visit(rot, y, kLeft, f >> 1);
+        visit(rot, y, kRight, f << 1);
+        if (y + 1 < kH) visit(rot, y + 1, kDown, f);
+        visit(next_rot, y, kRotate, f);
+      }
+    }
+
+    std::swap(frontier, next);
+    min_y = next_min_y;
+    max_y = next_max_y;
+    // 只有下落会改变y，而且只会增大
+    routes->max_y = std::max<unsigned>(routes->max_y, next_max_y);
+  }
+}
+
+template <Shape kShp>
+struct FindAllMovesKernel {
+  static void Run(const Situation& situ, const PlacementMap& map,
+                  BrickStatus initial_st, CandidateVector* res) {
+    res->clear();
+    if (!map.Fits(initial_st)) return;  // 放不下初始方块
+
+    RouteMap routes;
+    BuildRoutes<kRotCnt<kShp>>(&routes, map, initial_st);
+
+    ForEachRot<kShp>([&](auto rot) {
+      constexpr unsigned kRot = decltype(rot)::value;
+      routes.ForEachLanding(map, kRot, [&](unsigned x, unsigned y) {
+        Candidate& cand = res->emplace_back();
+        cand.st = {int8_t(x), int8_t(y), uint8_t(kRot)};
+        cand.situ = PutCopyKernel<kShp, kRot>::Run(situ, x, y);
+        if (cand.situ(0) != 0) {
+          res->pop_back();  // 碰顶算死
+          return;
+        }
+        cand.situ.CollapseInPlace();
+      });
+    });
+  }
+};
+
+}  // namespace
+
 std::string ShapeDebugString(Shape shp, unsigned rot) {
   char buf[5][5];
   memset(buf, ' ', sizeof(buf));
@@ -54,6 +248,33 @@ std::string Action::Join(std::span<const Action> actions) {
   return res;
 }
 
+bool Action::Parse(std::string_view s, std::vector<Action>* res) {
+  res->clear();
+  if (s.empty()) return true;
+  // 每个逗号后面都必须有一项，所以末尾的逗号是错误的
+  for (bool last = false; !last;) {
+    size_t pos = s.find(',');
+    last = pos == s.npos;
+    std::string_view item = s.substr(0, pos);
+    s.remove_prefix(last ? s.size() : pos + 1);
+
+    const char* p = item.empty() ? nullptr : strchr(kActionChars, item[0]);
+    if (!p || !*p) return false;
+    Action action{ActionType(p - kActionChars)};
+    // kNew不带数字，其他操作带1到255之间的数字
+    unsigned by = 0;
+    for (char c : item.substr(1)) {
+      if (c < '0' || c > '9' || (by = by * 10 + (c - '0')) > 255) return false;
+    }
+    if ((action.type == kNew) != (item.size() == 1) ||
+        (action.type != kNew && by == 0))
+      return false;
+    action.by = by;
+    res->push_back(action);
+  }
+  return true;
+}
+
 unsigned Situation::TotalOccupied() const {
   unsigned r = 0;
 #pragma unroll
@@ -77,30 +298,18 @@ uint32_t Situation::CollapsableBitmask() const {
 }
 
 bool Situation::Fits(Shape shape, BrickStatus st) const {
-  auto& pos = kShapeDesc[shape].pos[st.rot];
-  auto& bounds = kShapeBounds[shape][st.rot];
-
-  if (st.x + bounds.min_x < 0 || st.x + bounds.max_x >= int(kW)) return false;
-  // y 只用检查max即可，min可以小于0
-  if (st.y + bounds.max_y < 0 || st.y + bounds.max_y >= int(kH)) return false;
+  static constexpr auto kTable = MakeShapeRotTable<FitsKernel>();
+  return kTable[shape][st.rot](*this, st.x, st.y);
+}
 
-#pragma unroll
-  for (const Pos& pp : pos) {
-    int x = st.x + pp.x;
-    int y = st.y + pp.y;
-    if (y >= 0 && (*this)(x, y)) return false;
-  }
-  return true;
+PlacementMap Situation::MakePlacementMap(Shape shp) const {
+  static constexpr auto kTable = MakeShapeTable<MakePlacementMapKernel>();
+  return kTable[shp](*this);
 }
 
 Situation Situation::PutCopy(Shape shape, BrickStatus st) const {
-  Situation res = *this;
-  for (const Pos& pp : kShapeDesc[shape].pos[st.rot]) {
-    int x = st.x + pp.x;
-    int y = st.y + pp.y;
-    if (XInRange(x) && YInRange(y)) res(x, y) = true;
-  }
-  return res;
+  static constexpr auto kTable = MakeShapeRotTable<PutCopyKernel>();
+  return kTable[shape][st.rot](*this, st.x, st.y);
 }
 
 void Situation::CollapseInPlace() {
@@ -150,7 +359,15 @@ DEFINE_int32(quality_col_transition_penalty, 0, "");
 DEFINE_int32(quality_empty_penalty, 1080, "");
 DEFINE_int32(quality_empty_penalty2, 0, "");
 
-int Situation::Quality() const {
+QualityWeights QualityWeights::FromFlags() {
+  return {FLAGS_quality_row_transition_penalty,
+          FLAGS_quality_col_transition_penalty, FLAGS_quality_empty_penalty,
+          FLAGS_quality_empty_penalty2};
+}
+
+int Situation::Quality() const { return Quality(QualityWeights::FromFlags()); }
+
+int Situation::Quality(const QualityWeights& weights) const {
   // 格子数越多、越紧凑，得分越高
   int r = 0;
 
@@ -164,16 +381,15 @@ int Situation::Quality() const {
 
     // 越紧凑越好即左右相邻两格不相同的数量越少越好
     uint32_t alts = (row ^ (row >> 1)) & (kRowBitMask >> 1);
-    r -= FLAGS_quality_row_transition_penalty * popcnt(alts);
+    r -= weights.row_transition_penalty * popcnt(alts);
 
     // 上下不相同的惩罚
-    r -= FLAGS_quality_col_transition_penalty * popcnt(row ^ last_row);
+    r -= weights.col_transition_penalty * popcnt(row ^ last_row);
     last_row = row;
 
     // 每一个空格子如果上面有非空，减分
     uint32_t penalty = ~row & top_rows;
-    r -= (FLAGS_quality_empty_penalty - FLAGS_quality_empty_penalty2) *
-         popcnt(penalty);
+    r -= (weights.empty_penalty - weights.empty_penalty2) * popcnt(penalty);
 
     // 纵向累积
     top_rows |= row;
@@ -185,7 +401,7 @@ int Situation::Quality() const {
 
     // 下方有空格的砖块扣分
     uint32_t penalty = row & ~bottom_rows;
-    r -= FLAGS_quality_empty_penalty2 * popcnt(penalty);
+    r -= weights.empty_penalty2 * popcnt(penalty);
 
     bottom_rows &= row;
   }
@@ -210,201 +426,222 @@ bool Situation::IsOk() const {
   return true;
 }
 
-void Situation::FindAllMoves(Shape shp, BrickStatus initial_st,
-                             CandidateVector* res) const {
-  res->clear();
-  if (!Fits(shp, initial_st)) return;  // 放不下初始方块
-  for (uint32_t rot = 0; rot < kShapeDesc[shp].cnt; ++rot) {
-    uint32_t remaining_x_bitmask = kRowBitMask;
-    for (unsigned y = kH - 1; y > 0; --y) {  // y=0不用考虑
-      if (remaining_x_bitmask == 0) break;
-      uint32_t row = row_[y];
-      for (unsigned x : set_bits(remaining_x_bitmask & ~row)) {
-        BrickStatus st{int8_t(x), int8_t(y), uint8_t(rot)};
-        if (Fits(shp, st) && !Fits(shp, st.ReplaceY(y + 1))) {
-          Candidate& cand = res->emplace_back();
-          cand.st = st;
-          cand.situ = PutCopy(shp, st);
-          if (cand.situ(0) != 0) {
-            res->pop_back();  // 碰顶算死
-            continue;
-          }
-          if (!AppendRoute(shp, initial_st, st, &cand.actions)) {
-            res->pop_back();  // 不可达
-            continue;
-          }
-          cand.situ.CollapseInPlace();
+namespace {
 
-          // 同一个x有多个有意义的y位置的可能性很小，清除掉bitmask
-          remaining_x_bitmask &= ~(1 << x);
-        }
-      }
-    }
-  }
+// 每个16位通道分别计算popcount
+RowBatch PopcntBatch(RowBatch x) {
+  x = x - ((x >> 1) & 0x5555);
+  x = (x & 0x3333) + ((x >> 2) & 0x3333);
+  x = (x + (x >> 4)) & 0x0f0f;
+  return (x + (x >> 8)) & 0x1f;
+}
+
+// mask为全1的通道取a，否则取b
+RowBatch SelectBatch(RowBatch mask, RowBatch a, RowBatch b) {
+  return (a & mask) | (b & ~mask);
 }
 
-// 旋转
-bool Situation::RotateRouteAppend(Shape shp, BrickStatus from, uint8_t to_rot,
-                                  ActionVector* res) const {
-  if (from.rot != to_rot) {
-    uint32_t rot_cnt = kShapeDesc[shp].cnt;
+}  // namespace
 
-    uint8_t cnt = 0;
-    uint8_t rot = from.rot;
-    while (rot != to_rot) {
-      ++cnt;
-      rot = (rot + 1) & (rot_cnt - 1);
-      if (!Fits(shp, from.ReplaceRot(rot))) return false;
+void EvaluateBatch(std::span<const Situation> situs,
+                   const QualityWeights& weights, int* quality,
+                   unsigned* height, bool* ok) {
+  constexpr uint16_t kRowBitMask = Situation::kRowBitMask;
+  constexpr unsigned kThresholdLines = 5;  // 同IsOk()
+
+  for (size_t base = 0; base < situs.size(); base += kBatchSize) {
+    unsigned n = std::min<size_t>(kBatchSize, situs.size() - base);
+    const Situation* p = &situs[base];
+
+    RowBatch rows[kH];
+    for (unsigned y = 0; y < kH; ++y) {
+      RowBatch row{};
+      for (unsigned i = 0; i < n; ++i) row[i] = p[i](y);
+      rows[y] = row;
     }
-    if (!Fits(shp, from.ReplaceRot(to_rot))) return false;
-    if (cnt) res->push_back({kRotate, cnt});
-  }
-  return true;
-}
 
-// 水平移动
-bool Situation::HorizontalRouteAppend(Shape shp, BrickStatus from, int to_x,
-                                      ActionVector* res) const {
-  if (from.x != to_x) {
-    int delta = (to_x > from.x) ? 1 : -1;
-    for (int x = from.x; x != to_x; x += delta) {
-      if (!Fits(shp, from.ReplaceX(x + delta))) return false;
+    // 各项计数，含义与Situation::Quality()中的各项相同
+    RowBatch occupied{}, row_alts{}, col_alts{}, empty{}, empty2{};
+    RowBatch top_rows{}, last_row{};
+    for (unsigned y = 0; y < kH; ++y) {
+      RowBatch row = rows[y];
+      occupied += PopcntBatch(row);
+      row_alts += PopcntBatch((row ^ (row >> 1)) & (kRowBitMask >> 1));
+      col_alts += PopcntBatch(row ^ last_row);
+      last_row = row;
+      empty += PopcntBatch(~row & top_rows);
+      top_rows |= row;
+    }
+    RowBatch bottom_rows = RowBatch{} + kRowBitMask;
+    for (int y = kH - 1; y >= 0; --y) {
+      empty2 += PopcntBatch(rows[y] & ~bottom_rows);
+      bottom_rows &= rows[y];
     }
 
-    if (to_x > from.x) {
-      res->push_back({kRight, uint8_t(to_x - from.x)});
-    } else {
-      res->push_back({kLeft, uint8_t(from.x - to_x)});
+    // OccupiedHeight()：最上面的非空行
+    RowBatch occupied_height{};
+    for (int y = kH - 1; y >= 0; --y)
+      occupied_height = SelectBatch(RowBatch(rows[y] != 0),
+                                    RowBatch{} + uint16_t(kH - y),
+                                    occupied_height);
+
+    // IsOk()：最上面kThresholdLines行中格子最多的一行
+    // 更上面的行都是空的，所以只需要限制y < kH - occupied_height + 5
+    RowBatch top_max{};
+    for (uint16_t y = 0; y < kH; ++y) {
+      RowBatch cnt =
+          PopcntBatch(rows[y]) &
+          RowBatch(occupied_height + y < uint16_t(kH + kThresholdLines));
+      top_max = SelectBatch(RowBatch(cnt > top_max), cnt, top_max);
+    }
+
+    for (unsigned i = 0; i < n; ++i) {
+      quality[base + i] =
+          600 * occupied[i] - weights.row_transition_penalty * row_alts[i] -
+          weights.col_transition_penalty * col_alts[i] -
+          (weights.empty_penalty - weights.empty_penalty2) * empty[i] -
+          weights.empty_penalty2 * empty2[i];
+      height[base + i] = occupied_height[i];
+      ok[base + i] =
+          !(occupied_height[i] >= kThresholdLines && top_max[i] <= 3);
     }
   }
-  return true;
 }
 
-// 旋转、左右移动、下移
-bool Situation::AppendRouteNaive(Shape shp, BrickStatus from, BrickStatus to,
-                                 ActionVector* res) const {
-  if (to.y < from.y) return false;
+void Situation::FindAllMoves(Shape shp, BrickStatus initial_st,
+                             CandidateVector* res) const {
+  FindAllMoves(MakePlacementMap(shp), initial_st, res);
+}
 
-  size_t size = res->size();
+void Situation::FindAllMoves(const PlacementMap& map, BrickStatus initial_st,
+                             CandidateVector* res) const {
+  static constexpr auto kTable = MakeShapeTable<FindAllMovesKernel>();
+  kTable[map.shp](*this, map, initial_st, res);
+}
 
-  // 先旋转，后左右移动
-  if (!RotateRouteAppend(shp, from, to.rot, res) ||
-      !HorizontalRouteAppend(shp, from.ReplaceRot(to.rot), to.x, res)) {
-    // 先左右，后旋转
-    res->resize(size);
-    if (!HorizontalRouteAppend(shp, from, to.x, res) ||
-        !RotateRouteAppend(shp, from.ReplaceX(to.x), to.rot, res)) {
-      res->resize(size);
-      return false;
+void Situation::FindAllMoves(Shape shp, std::span<const BrickStatus> landings,
+                             CandidateVector* res) const {
+  res->clear();
+  for (BrickStatus st : landings) {
+    Candidate& cand = res->emplace_back();
+    cand.st = st;
+    cand.situ = PutCopy(shp, st);
+    if (cand.situ(0) != 0) {
+      res->pop_back();  // 碰顶算死
+      continue;
     }
+    cand.situ.CollapseInPlace();
   }
-  from.x = to.x;
-  from.rot = to.rot;
-
-  // 上下移动
-  if (to.y > from.y) {
-    for (int y = from.y; y != to.y; ++y)
-      if (!Fits(shp, from.ReplaceY(y + 1))) {
-        res->resize(size);
-        return false;
-      }
-    res->push_back({kDown, uint8_t(to.y - from.y)});
-  }
+}
+
+bool Situation::FindRoute(BrickStatus st, ActionVector* res) const {
+  auto [shp, initial_st] = kBricks[step_];
+  PlacementMap map = MakePlacementMap(shp);
+  if (st.rot >= kShapeDesc[shp].cnt || !map.Fits(initial_st) || !map.Fits(st))
+    return false;
 
+  RouteMap routes;
+  routes.Build(map, initial_st);
+  if (!routes.Reachable(st)) return false;
+  routes.AppendRoute(st, res);
   return true;
 }
 
-// 完整的寻路
-bool Situation::AppendRoute(Shape shp, BrickStatus from, BrickStatus to,
-                            ActionVector* res, int options) const {
-  size_t size = res->size();
-
-  // 先尝试常规路线
-  if (AppendRouteNaive(shp, from, to, res)) return true;
-
-  // 不行？在to的左、右各考虑5个位置
-  constexpr int kBottomLeftRight = 1;
-  if (!(options & kBottomLeftRight)) {
-    for (int dir = 0; dir < 2; ++dir) {
-      for (unsigned dx = 1; dx <= 5; ++dx) {
-        int x = (dir == 0) ? to.x + dx : to.x - dx;
-        if (!XInRange(x)) break;
-        BrickStatus via = to.ReplaceX(x);
-        if (!Fits(shp, via)) break;
-        if (AppendRoute(shp, from, via, res, options | kBottomLeftRight) &&
-            HorizontalRouteAppend(shp, via, to.x, res))
-          return true;
-        res->resize(size);
-      }
-    }
-  }
+void FindAllLandings(const PlacementMap& map, BrickStatus initial_st,
+                     LandingVector* res) {
+  res->clear();
+  if (!map.Fits(initial_st)) return;  // 放不下初始方块
 
-  // 不行？在from的左、右各考虑5个位置
-  constexpr int kTopLeftRight = 2;
-  if (!(options & kTopLeftRight)) {
-    for (int dir = 0; dir < 2; ++dir) {
-      for (unsigned dx = 1; dx <= 5; ++dx) {
-        int x = (dir == 0) ? from.x + dx : from.x - dx;
-        if (!XInRange(x)) break;
-        BrickStatus via = from.ReplaceX(x);
-        if (!Fits(shp, via)) break;
-        if (HorizontalRouteAppend(shp, from, x, res) &&
-            AppendRoute(shp, via, to, res, options | kTopLeftRight))
-          return true;
-        res->resize(size);
-      }
-    }
+  RouteMap routes;
+  routes.Build(map, initial_st);
+
+  for (uint32_t rot = 0; rot < kShapeDesc[map.shp].cnt; ++rot) {
+    routes.ForEachLanding(map, rot, [&](unsigned x, unsigned y) {
+      res->push_back({int8_t(x), int8_t(y), uint8_t(rot)});
+    });
   }
+}
 
-  // 还是不行？先移动到上一个位置，再加下移试试
-  if (to.y > 1) {
-    BrickStatus via = to.ReplaceY(to.y - 1);
-    if (Fits(shp, via)) {
-      if (AppendRoute(shp, from, via, res, options) &&
-          AppendRouteNaive(shp, via, to, res))
-        return true;
-      res->resize(size);
+unsigned PlacementMap::MaxReachableY(BrickStatus initial_st) const {
+  unsigned cnt = kShapeDesc[shp].cnt;
+  uint16_t cur = 1 << initial_st.x;
+  unsigned y = initial_st.y;
+  for (;; ++y) {
+    uint16_t any_fits = 0;
+    for (unsigned rot = 0; rot < cnt; ++rot) any_fits |= fits[rot][y];
+    // 左右移动的闭包
+    for (uint16_t prev = 0; prev != cur;) {
+      prev = cur;
+      cur |= (cur << 1 | cur >> 1) & any_fits;
     }
+    if (y + 1 >= kH) break;
+    uint16_t below = 0;
+    for (unsigned rot = 0; rot < cnt; ++rot) below |= fits[rot][y + 1];
+    cur &= below;
+    if (cur == 0) break;
   }
+  return y;
+}
 
-  // 还是不行? 试试t-spin?
-  constexpr int kTSpin = 4;
-  if (!(options & kTSpin)) {
-    unsigned rot_cnt = kShapeDesc[shp].cnt;
-    for (uint8_t rot = to.rot; (rot = rot ? rot - 1 : rot_cnt - 1) != to.rot;) {
-      BrickStatus via = to.ReplaceRot(rot);
-      if (!Fits(shp, via)) break;
-      if (AppendRoute(shp, from, via, res, options | kTSpin) &&
-          RotateRouteAppend(shp, via, to.rot, res))
-        return true;
-      res->resize(size);
-    }
+void RouteMap::Build(const PlacementMap& map, BrickStatus initial_st) {
+  switch (kShapeDesc[map.shp].cnt) {
+    case 1:
+      BuildRoutes<1>(this, map, initial_st);
+      break;
+    case 2:
+      BuildRoutes<2>(this, map, initial_st);
+      break;
+    default:
+      BuildRoutes<4>(this, map, initial_st);
+      break;
   }
+}
 
-  // 还是不行？试试先旋转一个角度，再下落
-  constexpr int kInitialSpin = 8;
-  if (!(options & kInitialSpin)) {
-    unsigned rot_cnt = kShapeDesc[shp].cnt;
-    for (uint8_t rot = from.rot;
-         (rot = (rot + 1) & (rot_cnt - 1)) != from.rot;) {
-      BrickStatus via = from.ReplaceRot(rot);
-      if (!Fits(shp, via)) break;
-      if (RotateRouteAppend(shp, from, rot, res) &&
-          AppendRoute(shp, via, to, res, options | kInitialSpin))
-        return true;
-      res->resize(size);
+void RouteMap::AppendRoute(BrickStatus st, ActionVector* res) const {
+  // 倒着走回起点
+  ActionType moves[kMaxMovesPerBrick];
+  unsigned n = 0;
+  while (st.x != from.x || st.y != from.y || st.rot != from.rot) {
+    auto& v = via[st.rot][st.y];
+    uint32_t bit = 1u << st.x;
+    ActionType type = (v[kDown] & bit)    ? kDown
+                      : (v[kLeft] & bit)  ? kLeft
+                      : (v[kRight] & bit) ? kRight
+                                          : kRotate;
+    moves[n++] = type;
+    switch (type) {
+      case kDown:
+        --st.y;
+        break;
+      case kLeft:
+        ++st.x;
+        break;
+      case kRight:
+        --st.x;
+        break;
+      default:
+        st.rot = (st.rot + rot_cnt - 1) & (rot_cnt - 1);
+        break;
     }
   }
 
-  return false;
+  // 合并连续的同类操作
+  while (n) {
+    ActionType type = moves[--n];
+    if (!res->empty() && res->back().type == type)
+      ++res->back().by;
+    else
+      res->push_back({type, 1});
+  }
 }
 
-bool Situation::ReplayAndVerify(std::span<const Action> actions,
-                                const Situation& target) const {
+bool Situation::ReplayMoves(std::span<const Action> actions,
+                            BrickStatus* res) const {
   auto shp = kBricks[step_].first;
   auto st = kBricks[step_].second;
+  PlacementMap map = MakePlacementMap(shp);
 
-  if (!Fits(shp, st)) {
+  if (!map.Fits(st)) {
     fprintf(stderr, "Initial block doesn't fit\n");
     return false;
   }
@@ -420,7 +657,7 @@ bool Situation::ReplayAndVerify(std::span<const Action> actions,
       case kRotate:
         for (unsigned i = action.by; i; --i) {
           st = st.ReplaceRot((st.rot + 1) & (kShapeDesc[shp].cnt - 1));
-          if (!Fits(shp, st)) {
+          if (!map.Fits(st)) {
             fprintf(stderr, "Failed in rotation\n");
             return false;
           }
@@ -433,7 +670,7 @@ bool Situation::ReplayAndVerify(std::span<const Action> actions,
             return false;
           }
           st = st.ReplaceX(st.x - 1);
-          if (!Fits(shp, st)) {
+          if (!map.Fits(st)) {
             fprintf(stderr, "Failed in kLeft (x = %u)\n", unsigned(st.x));
             return false;
           }
@@ -446,7 +683,7 @@ bool Situation::ReplayAndVerify(std::span<const Action> actions,
             return false;
           }
           st = st.ReplaceX(st.x + 1);
-          if (!Fits(shp, st)) {
+          if (!map.Fits(st)) {
             fprintf(stderr, "Failed in kRight (x = %u)\n", unsigned(st.x));
             return false;
           }
@@ -459,7 +696,7 @@ bool Situation::ReplayAndVerify(std::span<const Action> actions,
             return false;
           }
           st = st.ReplaceY(st.y + 1);
-          if (!Fits(shp, st)) {
+          if (!map.Fits(st)) {
             fprintf(stderr, "Failed in kDown (x = %u)\n", unsigned(st.x));
             return false;
           }
@@ -468,7 +705,16 @@ bool Situation::ReplayAndVerify(std::span<const Action> actions,
     }
   }
 
-  Situation new_st = PutCopy(shp, st);
+  *res = st;
+  return true;
+}
+
+bool Situation::ReplayAndVerify(std::span<const Action> actions,
+                                const Situation& target) const {
+  BrickStatus st;
+  if (!ReplayMoves(actions, &st)) return false;
+
+  Situation new_st = PutCopy(kBricks[step_].first, st);
   new_st.CollapseInPlace();
   if (!new_st.BricksEqual(target)) {
     fprintf(stderr, "Final situations are different:\n%s\n%s",
@@ -490,3 +736,55 @@ int Situation::BricksComp(const Situation& other) const {
       return row_4_[i] > other.row_4_[i] ? 1 : -1;
   return 0;
 }
+
+bool ReplaySolution(std::span<const Action> actions, Situation* res) {
+  Situation situ;
+  if (actions.empty() || actions[0].type != kNew) {
+    fprintf(stderr, "Actions must start with N\n");
+    return false;
+  }
+
+  size_t i = 0;
+  while (i < actions.size()) {
+    if (situ.step_ >= kSteps) {
+      fprintf(stderr, "Too many bricks\n");
+      return false;
+    }
+
+    // 本方块的操作是下一个kNew之前的部分
+    size_t end = i + 1;
+    unsigned moves = 0;
+    for (; end < actions.size() && actions[end].type != kNew; ++end)
+      moves += actions[end].by;
+    std::span<const Action> brick_actions = actions.subspan(i + 1, end - i - 1);
+    if (moves == 0 || moves > kMaxMovesPerBrick) {
+      fprintf(stderr, "Brick %u has %u moves\n", situ.step_, moves);
+      return false;
+    }
+
+    BrickStatus st;
+    if (!situ.ReplayMoves(brick_actions, &st)) {
+      fprintf(stderr, "Failed to replay brick %u\n", situ.step_);
+      return false;
+    }
+    situ = situ.PutCopy(kBricks[situ.step_].first, st);
+    i = end;
+
+    // 触顶（每一行都有格子）时游戏结束，不计分，之后不能再有操作
+    bool top_touched = true;
+    for (unsigned y = 0; y < kH; ++y) top_touched &= situ(y) != 0;
+    if (top_touched) {
+      ++situ.step_;
+      if (i != actions.size()) {
+        fprintf(stderr, "Actions after top touched at brick %u\n",
+                situ.step_ - 1);
+        return false;
+      }
+      break;
+    }
+    situ.CollapseInPlace();
+  }
+
+  *res = situ;
+  return true;
+}
@@ -2,11 +2,13 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <array>
 #include <bit>
 #include <memory>
 #include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <absl/container/inlined_vector.h>
@@ -137,6 +139,8 @@ struct Action {
 
   void AppendTo(std::string* s) const;
   static std::string Join(std::span<const Action> actions);
+  // Join的逆操作，格式错误时返回false
+  static bool Parse(std::string_view s, std::vector<Action>* res);
 };
 
 // 描述当前块的当前位置和姿势
@@ -193,6 +197,87 @@ constexpr std::array<std::pair<Shape, BrickStatus>, kSteps> GenBricks() {
 
 constexpr auto kBricks = GenBricks();
 
+// 某种方块在一个局面下所有可以放下的位置
+// fits[rot][y] 的第x位为1，表示 BrickStatus{x, y, rot} 可以放下
+struct PlacementMap {
+  Shape shp;
+  // 多留一行 fits[rot][kH]，恒为0，方便计算落点
+  uint16_t fits[4][kH + 1];
+
+  bool Fits(BrickStatus st) const {
+    return XInRange(st.x) && YInRange(st.y) && (fits[st.rot][st.y] >> st.x & 1);
+  }
+
+  // 可以放下，但不能再下落一格的位置
+  uint16_t LandingBitmask(unsigned rot, unsigned y) const {
+    return fits[rot][y] & ~fits[rot][y + 1];
+  }
+
+  // 从initial_st出发，方块可能到达的最大y（偏大的估计）
+  // 不区分方向，把所有方向能放下的位置合起来做一次洪泛
+  unsigned MaxReachableY(BrickStatus initial_st) const;
+};
+
+// 游戏规定两个方块之间的操作次数不能超过100
+constexpr unsigned kMaxMovesPerBrick = 100;
+
+// 在 (x, y, rot) 状态空间上按位并行地做广度优先搜索
+// 得到一个方块所有可达的位置，以及到达每个位置的最短操作序列
+struct RouteMap {
+  BrickStatus from;
+  uint8_t rot_cnt;
+  // 可达的最大y，落点只可能在from.y到这一行之间，不必扫描所有行
+  uint8_t max_y;
+  // reached[rot][y] 的第x位为1，表示 BrickStatus{x, y, rot} 可达
+  uint16_t reached[4][kH];
+  // via[rot][y][type] 的第x位为1，表示是通过type类型的操作第一次到达的
+  // （type为kDown, kLeft, kRight, kRotate之一）
+  uint16_t via[4][kH][4];
+
+  void Build(const PlacementMap& map, BrickStatus initial_st);
+
+  bool Reachable(BrickStatus st) const {
+    return reached[st.rot][st.y] >> st.x & 1;
+  }
+
+  // 可达且不能再下落一格的位置
+  uint16_t LandingBitmask(const PlacementMap& map, unsigned rot,
+                          unsigned y) const {
+    return reached[rot][y] & map.LandingBitmask(rot, y);
+  }
+
+  // 按y从大到小，对方向rot的每个落点调用func(x, y)
+  template <typename Callback>
+  void ForEachLanding(const PlacementMap& map, unsigned rot,
+                      Callback&& func) const {
+    unsigned min_y = std::max<unsigned>(from.y, 1);  // y=0不用考虑
+    for (unsigned y = max_y; y >= min_y; --y) {
+      for (unsigned x : set_bits(LandingBitmask(map, rot, y))) func(x, y);
+    }
+  }
+
+  // 将到达st的最短操作序列追加到res中，st必须可达
+  void AppendRoute(BrickStatus st, ActionVector* res) const;
+};
+
+// 一组可达的落点
+using LandingVector = std::vector<BrickStatus>;
+
+// 找出所有可达的落点，只与PlacementMap有关，与具体的局面无关
+void FindAllLandings(const PlacementMap& map, BrickStatus initial_st,
+                     LandingVector* res);
+
+// Situation::Quality()中各项的权重
+struct QualityWeights {
+  int row_transition_penalty;
+  int col_transition_penalty;
+  int empty_penalty;
+  int empty_penalty2;
+
+  // 取自--quality_*
+  static QualityWeights FromFlags();
+};
+
 // 代表一个目标位置
 struct Candidate;
 using CandidateVector = absl::InlinedVector<Candidate, kW>;
@@ -248,6 +333,9 @@ struct Situation {
   // 指定的块是否可以放下
   bool Fits(Shape shp, BrickStatus st) const;
 
+  // 用移位的行相与，一次算出所有可以放下的位置
+  PlacementMap MakePlacementMap(Shape shp) const;
+
   // 将一个块放在指定位置，并返回新画布
   Situation PutCopy(Shape shp, BrickStatus st) const;
 
@@ -255,24 +343,30 @@ struct Situation {
   void CollapseInPlace();
 
   // 堆叠紧凑度得分
+  int Quality(const QualityWeights& weights) const;
+  // 同上，权重取自--quality_*
   int Quality() const;
 
   // 如果是明显不好的局面，返回false，直接剪掉
   bool IsOk() const;
 
-  // 找出所有可能的动作
+  // 找出所有可能的动作，只判断落点是否可达，不生成操作序列
   void FindAllMoves(Shape st, BrickStatus initial_st,
                     CandidateVector* res) const;
+  // 同上，使用已经算好的PlacementMap
+  void FindAllMoves(const PlacementMap& map, BrickStatus initial_st,
+                    CandidateVector* res) const;
+  // 同上，使用已经算好的落点
+  void FindAllMoves(Shape shp, std::span<const BrickStatus> landings,
+                    CandidateVector* res) const;
+
+  // 把第step_个方块从初始位置移动到st的最短操作序列追加到res中
+  // 与FindAllMoves用的是同样的寻路方法，st不可达时返回false
+  bool FindRoute(BrickStatus st, ActionVector* res) const;
 
-  // 找路
-  bool RotateRouteAppend(Shape shp, BrickStatus from, uint8_t to_rot,
-                         ActionVector* res) const;
-  bool HorizontalRouteAppend(Shape shp, BrickStatus from, int to_x,
-                             ActionVector* res) const;
-  bool AppendRouteNaive(Shape shp, BrickStatus from, BrickStatus to,
-                        ActionVector* res) const;
-  bool AppendRoute(Shape shp, BrickStatus from, BrickStatus to,
-                   ActionVector* res, int options = 0) const;
+  // 把第step_个方块从初始位置开始按actions移动，最终位置写入res
+  // actions中不能有kNew，中途放不下时返回false
+  bool ReplayMoves(std::span<const Action> actions, BrickStatus* res) const;
 
   // 重放，用于验证，失败
   bool ReplayAndVerify(std::span<const Action> actions,
@@ -289,5 +383,26 @@ struct Situation {
 struct Candidate {
   BrickStatus st;
   Situation situ;
-  ActionVector actions;
 };
+
+// 按批处理时一次处理的局面数
+// 每个局面的一行占16位，一批正好填满一个向量寄存器
+#ifdef __AVX512BW__
+constexpr unsigned kBatchSize = 32;
+#else
+constexpr unsigned kBatchSize = 16;
+#endif
+using RowBatch = uint16_t __attribute__((vector_size(kBatchSize * 2)));
+
+// 对一批局面同时计算Quality()、OccupiedHeight()和IsOk()，结果写入对应的数组
+// 每kBatchSize个局面的同一行排在一个RowBatch里，用SIMD做popcount等计算
+// 注：试过由父结点的各行各列增量计算没有消行的子结点的quality，
+// 但更新几列空格扣分的标量计算比这里摊到每个局面的开销还大，所以没有采用
+void EvaluateBatch(std::span<const Situation> situs,
+                   const QualityWeights& weights, int* quality,
+                   unsigned* height, bool* ok);
+
+// 从空白局面开始重放完整的操作序列（即提交的内容），按游戏的规则检查：
+// 以kNew开头，每个方块的操作次数在(0, kMaxMovesPerBrick]之间，触顶以后不能再有操作
+// 成功时最终局面写入res
+bool ReplaySolution(std::span<const Action> actions, Situation* res);
@@ -1,56 +1,183 @@
 #include "thread_pool.h"
 
-ThreadPool::ThreadPool() {
-  for (unsigned i = 0; i < kThreads; ++i)
-    threads_[i] = std::thread([this] { Main(); });
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+thread_local unsigned ThreadPool::current_index_ = 0;
+
+namespace {
+
+// 本进程允许运行的CPU列表
+std::vector<unsigned> AvailableCpus() {
+  std::vector<unsigned> res;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (unsigned i = 0; i < CPU_SETSIZE; ++i)
+      if (CPU_ISSET(i, &set)) res.push_back(i);
+  }
+  if (res.empty()) {
+    unsigned n = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < n; ++i) res.push_back(i);
+  }
+  return res;
 }
 
-void ThreadPool::Stop() {
-  Submit(kThreads, std::function<void()>());
-  for (std::thread& thread : threads_) thread.join();
+// 自旋等待的次数，超过以后休眠
+constexpr unsigned kSpinCount = 1 << 14;
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+void PinCurrentThread(unsigned cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    fprintf(stderr, "Failed to pin thread to CPU %u: error %d\n", cpu, err);
 }
 
-void ThreadPool::Submit(std::function<void()> func) {
-  {
-    std::lock_guard lock(mutex_);
-    queue_.push(std::move(func));
+}  // namespace
+
+ThreadPool::ThreadPool(unsigned threads, bool pin) {
+  std::vector<unsigned> cpus = AvailableCpus();
+  size_ = threads ? threads : cpus.size();
+  spin_count_ = size_ <= cpus.size() ? kSpinCount : 0;
+  ranges_ = std::make_unique<Range[]>(size_);
+
+  if (pin) PinCurrentThread(cpus[0]);
+  threads_.reserve(size_ - 1);
+  for (unsigned i = 1; i < size_; ++i) {
+    int cpu = pin ? int(cpus[i % cpus.size()]) : -1;
+    threads_.emplace_back([this, i, cpu] {
+      if (cpu >= 0) PinCurrentThread(cpu);
+      Main(i);
+    });
   }
-  cv_.notify_one();
 }
 
-void ThreadPool::Submit(size_t n, std::function<void()> func) {
-  if (n == 0) return;
-  {
-    std::lock_guard lock(mutex_);
-    for (size_t i = 1; i < n; ++i) queue_.push(func);
-    queue_.push(std::move(func));
+ThreadPool::~ThreadPool() {
+  stop_ = true;
+  epoch_.fetch_add(1);
+  NotifyChange(epoch_, epoch_sleepers_);
+  for (std::thread& thread : threads_) thread.join();
+}
+
+uint32_t ThreadPool::WaitChange(const std::atomic<uint32_t>& value,
+                                uint32_t old,
+                                std::atomic<unsigned>& sleepers) const {
+  uint32_t v;
+  for (unsigned i = 0; i < spin_count_; ++i) {
+    if ((v = value.load(std::memory_order_acquire)) != old) return v;
+    CpuRelax();
   }
-  if (n > 1)
-    cv_.notify_all();
-  else
-    cv_.notify_one();
+  // 先登记再检查value，与NotifyChange中先修改value再检查sleepers配合，
+  // 保证不会错过唤醒
+  sleepers.fetch_add(1);
+  while ((v = value.load()) == old) value.wait(old);
+  sleepers.fetch_sub(1);
+  return v;
+}
+
+void ThreadPool::NotifyChange(std::atomic<uint32_t>& value,
+                              std::atomic<unsigned>& sleepers) {
+  if (sleepers.load() != 0) value.notify_all();
 }
 
-void ThreadPool::Submit(std::span<std::function<void()>> funcs) {
-  if (funcs.empty()) return;
-  for (std::lock_guard lock(mutex_); auto& func : funcs)
-    queue_.push(std::move(func));
-  if (funcs.size() > 1)
-    cv_.notify_all();
-  else
-    cv_.notify_one();
+void ThreadPool::Run(const Task& task) {
+  if (task.n == 0) return;
+  if (task.n > UINT32_MAX) {
+    fprintf(stderr, "Too many items for ThreadPool: %zu\n", task.n);
+    exit(1);
+  }
+
+  size_t grain = std::max<size_t>(task.grain, 1);
+  if (size_ == 1 || task.n <= grain) {
+    task.run(task.ctx, 0, task.n);
+    return;
+  }
+
+  // 预先平均分给各个线程
+  for (unsigned i = 0; i < size_; ++i)
+    ranges_[i].value.store(
+        PackRange(task.n * i / size_, task.n * (i + 1) / size_),
+        std::memory_order_relaxed);
+
+  // 此时工作线程都在等待epoch_变化，不会读取task_
+  task_ = task;
+  task_.grain = grain;
+  pending_.store(size_ - 1, std::memory_order_relaxed);
+  epoch_.fetch_add(1);
+  NotifyChange(epoch_, epoch_sleepers_);
+
+  Work(0);
+
+  for (uint32_t v; (v = pending_.load(std::memory_order_acquire)) != 0;)
+    WaitChange(pending_, v, pending_sleepers_);
 }
 
-void ThreadPool::Main() {
+void ThreadPool::Work(unsigned index) {
+  const Task task = task_;
+  Range& own = ranges_[index];
   for (;;) {
-    std::function<void()> func;
-    {
-      std::unique_lock lock(mutex_);
-      cv_.wait(lock, [this] { return !queue_.empty(); });
-      func = queue_.front();
-      queue_.pop();
+    uint64_t v = own.value.load(std::memory_order_acquire);
+    for (;;) {
+      uint32_t begin = v >> 32;
+      uint32_t end = uint32_t(v);
+      if (begin >= end) break;
+      uint32_t next = std::min<size_t>(end, begin + task.grain);
+      if (own.value.compare_exchange_weak(v, PackRange(next, end),
+                                          std::memory_order_acq_rel)) {
+        task.run(task.ctx, begin, next);
+        v = own.value.load(std::memory_order_acquire);
+      }
     }
-    if (!func) break;
-    func();
+
+    uint32_t begin, end;
+    if (!Steal(index, &begin, &end)) break;
+    // 自己的区间此时为空，其他线程不会修改它
+    own.value.store(PackRange(begin, end), std::memory_order_release);
+  }
+}
+
+bool ThreadPool::Steal(unsigned index, uint32_t* begin, uint32_t* end) {
+  for (unsigned k = 1; k < size_; ++k) {
+    Range& victim = ranges_[(index + k) % size_];
+    uint64_t v = victim.value.load(std::memory_order_acquire);
+    for (;;) {
+      uint32_t b = v >> 32;
+      uint32_t e = uint32_t(v);
+      if (b >= e) break;
+      // 剩余不多时整段拿走
+      uint32_t mid = e - b <= task_.grain ? b : b + (e - b) / 2;
+      if (victim.value.compare_exchange_weak(v, PackRange(b, mid),
+                                             std::memory_order_acq_rel)) {
+        *begin = mid;
+        *end = e;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void ThreadPool::Main(unsigned index) {
+  current_index_ = index;
+  uint32_t epoch = 0;
+  for (;;) {
+    epoch = WaitChange(epoch_, epoch, epoch_sleepers_);
+    if (stop_) break;
+
+    Work(index);
+
+    pending_.fetch_sub(1);
+    NotifyChange(pending_, pending_sleepers_);
   }
 }
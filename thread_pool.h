@@ -1,66 +1,99 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <atomic>
-#include <condition_variable>
-#include <functional>
-#include <mutex>
-#include <queue>
+#include <memory>
 #include <span>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
-constexpr unsigned kThreads = 8;
-
+// 工作窃取的线程池
+// 调用线程自己也参与计算，序号为0；池中另外启动threads-1个线程，序号为1..threads-1
+// 同一时间只执行一个任务（一段下标区间），调用者等待任务完成后返回
+// 线程常驻：发布任务只是递增epoch_，等待时先自旋一段时间再休眠，
+// 所以连续执行很多小任务时同步开销很小
 class ThreadPool {
  public:
-  ThreadPool();
+  // threads为0时按本进程可用的CPU数量确定；pin为真时把每个线程绑定到一个CPU上
+  explicit ThreadPool(unsigned threads = 0, bool pin = false);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool();
 
-  ~ThreadPool() { Stop(); }
+  // 线程数（包括调用线程）
+  unsigned size() const { return size_; }
 
-  // 提交单个任务
-  void Submit(std::function<void()> func);
+  // 当前线程在线程池中的序号，不是线程池中的线程则返回0
+  static unsigned CurrentIndex() { return current_index_; }
 
-  // 提交多个相同任务
-  void Submit(size_t n, std::function<void()> func);
-
-  // 提交一系列任务
-  void Submit(std::span<std::function<void()>> funcs);
+  // 对[0, n)中的每一段区间调用func(begin, end)，并等待执行完成
+  // 每个线程一开始分得连续的一段，每次从自己那段的头部取grain个；
+  // 自己那段取完以后，从其他线程剩余部分的尾部窃取一半
+  template <typename Callback>
+  void SyncRunRange(size_t n, size_t grain, Callback&& func) {
+    using Func = std::remove_reference_t<Callback>;
+    Run({[](void* ctx, size_t begin, size_t end) {
+           (*static_cast<Func*>(ctx))(begin, end);
+         },
+         const_cast<void*>(static_cast<const void*>(&func)), n, grain});
+  }
 
-  // 提交一系列任务，每一个都用func执行，并等待执行完成
+  // 对data中的每一个元素调用func，并等待执行完成
   template <typename T, typename Callback>
-  void SyncRunSpan(std::span<T> data, Callback func) {
-    unsigned n = data.size();
-    if (n == 0) return;
+  void SyncRunSpan(std::span<T> data, Callback func, size_t grain = 1) {
+    SyncRunRange(data.size(), grain, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) func(data[i]);
+    });
+  }
 
-    std::condition_variable cv;
-    std::mutex mutex;
-    unsigned num = std::min(n, kThreads);
+ private:
+  // 类型擦除后的任务，避免std::function的分配
+  struct Task {
+    void (*run)(void* ctx, size_t begin, size_t end);
+    void* ctx;
+    size_t n;
+    size_t grain;
+  };
 
-    std::atomic<unsigned> head{0};
+  // 每个线程剩余的区间，高32位为begin，低32位为end
+  struct alignas(64) Range {
+    std::atomic<uint64_t> value{0};
+  };
 
-    Submit(num, [&] {
-      unsigned k;
-      while ((k = head.fetch_add(1)) < n) func(data[k]);
+  static uint64_t PackRange(uint32_t begin, uint32_t end) {
+    return uint64_t(begin) << 32 | end;
+  }
 
-      {
-        std::lock_guard lock(mutex);
-        --num;
-      }
-      cv.notify_one();
-    });
+  void Run(const Task& task);
+  void Work(unsigned index);
+  bool Steal(unsigned index, uint32_t* begin, uint32_t* end);
+  void Main(unsigned index);
 
-    {
-      std::unique_lock lock(mutex);
-      cv.wait(lock, [&] { return num == 0; });
-    }
-  }
+  // 等待value不再等于old：先自旋，超时后休眠
+  // sleepers记录正在休眠的线程数，唤醒方据此决定是否需要系统调用
+  uint32_t WaitChange(const std::atomic<uint32_t>& value, uint32_t old,
+                      std::atomic<unsigned>& sleepers) const;
+  static void NotifyChange(std::atomic<uint32_t>& value,
+                           std::atomic<unsigned>& sleepers);
 
- private:
-  void Main();
-  void Stop();
+  static thread_local unsigned current_index_;
 
  private:
-  std::thread threads_[kThreads];
-  std::queue<std::function<void()>> queue_;
-  std::mutex mutex_;
-  std::condition_variable cv_;
+  unsigned size_;
+  unsigned spin_count_;  // 线程数超过CPU数时不自旋
+  std::vector<std::thread> threads_;
+  std::unique_ptr<Range[]> ranges_;
+
+  Task task_{};
+  bool stop_ = false;
+
+  // 每发布一个任务递增一次，工作线程据此得知有新任务
+  alignas(64) std::atomic<uint32_t> epoch_{0};
+  std::atomic<unsigned> epoch_sleepers_{0};
+  // 尚未完成当前任务的工作线程数（不包括调用线程）
+  alignas(64) std::atomic<uint32_t> pending_{0};
+  std::atomic<unsigned> pending_sleepers_{0};
 };
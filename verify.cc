@@ -0,0 +1,85 @@
+#include <gflags/gflags.h>
+#include <stdio.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tetris_common.h"
+
+// 独立的验证程序：读出 out/<score>.submit.js 中的操作序列，按kBricks从头重放，
+// 检查是否合法、得到的分数是否与声明的一致
+// 用法：verify out/*.submit.js
+
+namespace {
+
+// 从submit.js中取出record和score，格式见main.cc中的kUploadTemplate
+bool ParseSubmit(const std::string& text, std::string* record,
+                 unsigned* score) {
+  static constexpr char kRecordPrefix[] = "record: '";
+  static constexpr char kScorePrefix[] = "score: ";
+  size_t begin = text.find(kRecordPrefix);
+  if (begin == text.npos) return false;
+  begin += sizeof(kRecordPrefix) - 1;
+  size_t end = text.find('\'', begin);
+  if (end == text.npos) return false;
+  *record = text.substr(begin, end - begin);
+
+  size_t pos = text.find(kScorePrefix, end);
+  if (pos == text.npos) return false;
+  return sscanf(text.c_str() + pos + sizeof(kScorePrefix) - 1, "%u",
+                score) == 1;
+}
+
+bool VerifyFile(const std::string& path) {
+  std::ifstream in(path);
+  if (!in) {
+    fprintf(stderr, "%s: failed to open\n", path.c_str());
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+
+  std::string record;
+  unsigned claimed_score;
+  if (!ParseSubmit(buffer.str(), &record, &claimed_score)) {
+    fprintf(stderr, "%s: no record or score found\n", path.c_str());
+    return false;
+  }
+
+  std::vector<Action> actions;
+  if (!Action::Parse(record, &actions)) {
+    fprintf(stderr, "%s: invalid action string\n", path.c_str());
+    return false;
+  }
+
+  Situation situ;
+  if (!ReplaySolution(actions, &situ)) {
+    fprintf(stderr, "%s: replay failed\n", path.c_str());
+    return false;
+  }
+  if (situ.score_ != claimed_score) {
+    fprintf(stderr, "%s: score %u, but %u is claimed\n", path.c_str(),
+            situ.score_, claimed_score);
+    return false;
+  }
+
+  printf("%s: OK, %u bricks, score %u\n", path.c_str(), situ.step_,
+         situ.score_);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <score>.submit.js...\n", argv[0]);
+    return 1;
+  }
+
+  bool ok = true;
+  for (int i = 1; i < argc; ++i) ok &= VerifyFile(argv[i]);
+  return ok ? 0 : 1;
+}